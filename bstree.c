@@ -17,34 +17,90 @@
 */
 
 #include "bstree.h"
+#include "bstree_impl.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
 
 #define MAX_IMBALANCE 1
 
+/* Pooled trees carve their nodes out of chunks, the first one holding
+ * POOL_MIN_CHUNK nodes and every next one twice as many as the previous, up
+ * to POOL_MAX_CHUNK.
+ */
+#define POOL_MIN_CHUNK 64
+#define POOL_MAX_CHUNK 65536
+
+/* The number of lookups bstree_search_batch walks down the tree together.
+ */
+#define BATCH_WIDTH 16
+
+/* Trees set to use several threads hand subtrees of at least this many nodes
+ * over to another thread.
+ */
+#define PARALLEL_GRAIN 16384
+
+/* The counters of bstree_stats, see bstree_impl.h */
+#ifdef BSTREE_STATS
+struct bstree_counters bstree_counters_;
+#endif
+
 /* Structs for internal usage
  */
 
+/* The nodes of a struct bstree are nothing but links carrying a pointer to
+ * their object. The link being the first member, we can freely convert between
+ * the two, which lets the balancing code be shared with the intrusive trees.
+ */
 struct bstree_node {
+    struct bstree_link link;
     void *object;
-    struct bstree_node *left;
-    struct bstree_node *right;
-    int count;
-    int height;
 };
 
-struct bstree_ops {
-    int (*compare_object)(const void *lhs, const void *rhs);
-    /* If the user supplies a function to free the objects, then we know that
-     * we take the ownership of the resources, and we should eventually
-     * free every pointer we are given if we are still holding it in the end.
-     * If the freeing function is NULL, we just keep the pointers to the
-     * objects and never free them, that means the user manages the lifetime.
+/* Trees made with bstree_new_keyed have these nodes instead, holding the key
+ * prefix of their object.
+ */
+struct bstree_keyed_node {
+    struct bstree_node node;
+    uint64_t key;
+};
+
+/* The nodes in a chunk are node_size bytes apart, see chunk_node_ */
+struct bstree_chunk {
+    struct bstree_chunk *next;
+    size_t used;
+    size_t capacity;
+    struct bstree_node nodes[];
+};
+
+struct bstree_pool {
+    /* The head of the list is the chunk we are currently allocating from */
+    struct bstree_chunk *chunks;
+    /* Nodes given back by removals, linked through their left pointers */
+    struct bstree_link *free_nodes;
+    size_t node_size;
+    /* The number of trees allocating from the pool, more than one after
+     * bstree_split
      */
-    void (*free_object)(void *object);
+    int users;
+};
+
+/* A direct mapped cache of the nodes last found by bstree_search and
+ * bstree_count, each kept in the slot its key hashes to. As the node found
+ * for a key is the only one matching it, removing the key only has to clear
+ * its slot. Operations moving many nodes at once clear the whole cache.
+ */
+struct bstree_cache {
+    uint64_t (*hash_object)(const void *object);
+    size_t mask;
+    long hits;
+    long misses;
+    const struct bstree_link *slots[];
 };
 
 /* Internal helper functions
@@ -55,54 +111,209 @@ static int int_max_(int a, int b)
     return a > b ? a : b;
 }
 
-static int height_(struct bstree_node *root)
+static struct bstree_node *node_(const struct bstree_link *link)
+{
+    return (struct bstree_node *)link;
+}
+
+static uint64_t key_(const struct bstree_link *link)
+{
+    return ((const struct bstree_keyed_node *)link)->key;
+}
+
+static size_t node_size_(const struct bstree_ops *ops)
+{
+    return ops->key_object ? sizeof(struct bstree_keyed_node)
+        : sizeof(struct bstree_node);
+}
+
+/* The prefix of a key we are going to compare against the nodes, computed
+ * once per operation.
+ */
+static uint64_t prefix_(const struct bstree_ops *ops, const void *key)
+{
+    return ops->key_object ? ops->key_object(key) : 0;
+}
+
+/* Compare the given key, its prefix being the one given by prefix_, to the
+ * object of the node. For keyed trees the objects only need to be compared
+ * for equal prefixes.
+ */
+static int compare_(const struct bstree_ops *ops, const void *key,
+        uint64_t prefix, const struct bstree_link *link)
+{
+    if (ops->key_object && prefix != key_(link)) {
+        return prefix < key_(link) ? -1 : 1;
+    }
+    COUNT_(compare_calls);
+    return ops->compare_object(key, node_(link)->object);
+}
+
+static int height_(const struct bstree_link *root)
 {
     return root ? root->height : -1;
 }
 
+static int size_(const struct bstree_link *root)
+{
+    return root ? root->size : 0;
+}
+
+static long size_cnt_(const struct bstree_link *root)
+{
+    return root ? root->size_cnt : 0;
+}
+
+/* Recompute the height and the subtree sizes held at the given node from its
+ * children.
+ */
+static void update_(struct bstree_link *root)
+{
+    root->height = int_max_(height_(root->left), height_(root->right)) + 1;
+    root->size = size_(root->left) + size_(root->right) + 1;
+    root->size_cnt = size_cnt_(root->left) + size_cnt_(root->right)
+        + root->count;
+}
+
+/* Add a chunk of the given capacity to the pool, making it the one we
+ * allocate from. Returns NULL, leaving the pool as it was, if it cannot be
+ * allocated.
+ */
+static struct bstree_chunk *pool_grow_(struct bstree_pool *pool,
+        size_t capacity)
+{
+    struct bstree_chunk *chunk;
+    chunk = malloc(sizeof *chunk + capacity * pool->node_size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = pool->chunks;
+    chunk->used = 0;
+    chunk->capacity = capacity;
+    pool->chunks = chunk;
+    return chunk;
+}
+
+static struct bstree_node *chunk_node_(struct bstree_chunk *chunk, size_t i,
+        size_t node_size)
+{
+    return (struct bstree_node *)((char *)chunk->nodes + i * node_size);
+}
+
+static struct bstree_node *pool_alloc_(struct bstree_pool *pool)
+{
+    struct bstree_chunk *chunk = pool->chunks;
+    struct bstree_link *link;
+    if (pool->free_nodes) {
+        link = pool->free_nodes;
+        pool->free_nodes = link->left;
+        return node_(link);
+    }
+    if (!chunk || chunk->used == chunk->capacity) {
+        size_t capacity = chunk ? chunk->capacity * 2 : POOL_MIN_CHUNK;
+        if (capacity > POOL_MAX_CHUNK) {
+            capacity = POOL_MAX_CHUNK;
+        }
+        chunk = pool_grow_(pool, capacity);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+    return chunk_node_(chunk, chunk->used++, pool->node_size);
+}
+
+static struct bstree_pool *pool_new_(size_t node_size)
+{
+    struct bstree_pool *pool = malloc(sizeof(*pool));
+    pool->chunks = NULL;
+    pool->free_nodes = NULL;
+    pool->node_size = node_size;
+    pool->users = 1;
+    return pool;
+}
+
+static void pool_destroy_(struct bstree_pool *pool)
+{
+    struct bstree_chunk *chunk, *next;
+    if (--pool->users > 0) {
+        return;
+    }
+    for (chunk = pool->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(pool);
+}
+
+static void free_node_(const struct bstree_ops *ops, struct bstree_link *link)
+{
+    if (ops->pool) {
+        link->left = ops->pool->free_nodes;
+        ops->pool->free_nodes = link;
+    } else {
+        free(node_(link));
+    }
+    COUNT_(nodes_freed);
+}
+
+/* Free a node detached from the tree, with its object if we own it.
+ */
+static void drop_(const struct bstree_ops *ops, struct bstree_link *link)
+{
+    if (ops->free_object) {
+        ops->free_object(node_(link)->object);
+    }
+    free_node_(ops, link);
+}
+
 /* Make a node that is a valid tree consisting of one node, only the root.
  */
-static struct bstree_node *mknode_(void *object)
+static struct bstree_link *mknode_(const struct bstree_ops *ops, void *object)
 {
-    struct bstree_node *root = malloc(sizeof *root);
+    struct bstree_node *root = ops->pool ? pool_alloc_(ops->pool)
+        : malloc(node_size_(ops));
+    COUNT_(nodes_allocated);
     root->object = object;
-    root->left = NULL;
-    root->right = NULL;
-    root->count = 1;
-    root->height = 0;
-    return root;
+    if (ops->key_object) {
+        ((struct bstree_keyed_node *)root)->key = ops->key_object(object);
+    }
+    root->link.left = NULL;
+    root->link.right = NULL;
+    root->link.count = 1;
+    root->link.height = 0;
+    root->link.size = 1;
+    root->link.size_cnt = 1;
+    return &root->link;
 }
 
-static struct bstree_node *rotate_with_left_(struct bstree_node *root)
+static struct bstree_link *rotate_with_left_(struct bstree_link *root)
 {
-    struct bstree_node *newroot = root->left;
+    struct bstree_link *newroot = root->left;
     root->left = newroot->right;
     newroot->right = root;
-    root->height = int_max_(height_(root->left), height_(root->right)) + 1;
-    newroot->height = int_max_(height_(newroot->left),
-            height_(newroot->right)) + 1;
+    update_(root);
+    update_(newroot);
     return newroot;
 }
 
-static struct bstree_node *rotate_with_right_(struct bstree_node *root)
+static struct bstree_link *rotate_with_right_(struct bstree_link *root)
 {
-    struct bstree_node *newroot = root->right;
+    struct bstree_link *newroot = root->right;
     root->right = newroot->left;
     newroot->left = root;
-    root->height = int_max_(height_(root->left), height_(root->right)) + 1;
-    newroot->height = int_max_(height_(newroot->left),
-            height_(newroot->right)) + 1;
+    update_(root);
+    update_(newroot);
     return newroot;
 }
 
-static struct bstree_node *double_with_left_(struct bstree_node *root)
+static struct bstree_link *double_with_left_(struct bstree_link *root)
 {
     root->left = rotate_with_right_(root->left);
     root = rotate_with_left_(root);
     return root;
 }
 
-static struct bstree_node *double_with_right_(struct bstree_node *root)
+static struct bstree_link *double_with_right_(struct bstree_link *root)
 {
     root->right = rotate_with_left_(root->right);
     root = rotate_with_right_(root);
@@ -115,87 +326,236 @@ static struct bstree_node *double_with_right_(struct bstree_node *root)
  * or imbalanced by 2 because of a recent insertion (or deletion).
  * If the latter is the case, this function restores the balance.
  */
-static struct bstree_node *balance_(struct bstree_node *root)
+static struct bstree_link *balance_(struct bstree_link *root)
 {
     if (!root) {
         return NULL;
     }
     if (height_(root->left) - height_(root->right) > MAX_IMBALANCE) {
-        if (height_(root->left->left) > height_(root->left->right)) {
+        if (height_(root->left->left) >= height_(root->left->right)) {
+            COUNT_(single_rotations);
             root = rotate_with_left_(root);
         } else {
+            COUNT_(double_rotations);
             root = double_with_left_(root);
         }
     } else if (height_(root->right) - height_(root->left) > MAX_IMBALANCE) {
-        if (height_(root->right->right) > height_(root->right->left)) {
+        if (height_(root->right->right) >= height_(root->right->left)) {
+            COUNT_(single_rotations);
             root = rotate_with_right_(root);
         } else {
+            COUNT_(double_rotations);
             root = double_with_right_(root);
         }
     }
-    root->height = int_max_(height_(root->left), height_(root->right)) + 1;
+    update_(root);
     return root;
 }
 
-static struct bstree_node *get_min_(struct bstree_node *root)
+/* Fix the subtree sizes of the nodes on the given path, bottom up.
+ */
+static void update_path_(struct bstree_link **path[], int depth)
 {
-    while (root && root->left) {
-        root = root->left;
+    while (depth-- > 0) {
+        update_(*path[depth]);
     }
-    return root;
 }
 
-static struct bstree_node *insert_(struct bstree_node *root,
-        const struct bstree_ops *ops, void *object)
+/* Walk back up to the root along the given path, restoring the balance of
+ * every node on it. Each element of the path is the address of the pointer
+ * leading to a node, so that the rotated subtrees can be linked back in place.
+ * Once the height of a subtree stays the same, no more rotations can be
+ * needed above it, and only the subtree sizes are left to fix.
+ */
+static void rebalance_path_(struct bstree_link **path[], int depth)
 {
-    if (!root) {
-        return mknode_(object);
+    while (depth-- > 0) {
+        struct bstree_link **link = path[depth];
+        int height = (*link)->height;
+        *link = balance_(*link);
+        if ((*link)->height == height) {
+            break;
+        }
     }
-    if (ops->compare_object(object, root->object) < 0) {
-        root->left = insert_(root->left, ops, object);
-        return balance_(root);
+    update_path_(path, depth);
+}
+
+/* Unlink the node held at *link from the tree, path being the links leading
+ * to it as recorded during the descent. The node itself is not touched, so
+ * it is up to the caller to dispose of it.
+ */
+static void unlink_(struct bstree_link **path[], int depth,
+        struct bstree_link **link)
+{
+    struct bstree_link *node = *link;
+    if (!node->left || !node->right) {
+        *link = node->left ? node->left : node->right;
+    } else {
+        /* Node to be deleted has two children. The minimum of the right
+         * subtree has no left child, so we can easily unlink it and put it in
+         * place of the deleted node.
+         */
+        struct bstree_link **min_link = &node->right;
+        struct bstree_link *min;
+        int top = depth;
+        path[depth++] = link;
+        while ((*min_link)->left) {
+            path[depth++] = min_link;
+            min_link = &(*min_link)->left;
+        }
+        min = *min_link;
+        *min_link = min->right;
+        min->left = node->left;
+        min->right = node->right;
+        min->height = node->height;
+        min->size = node->size;
+        min->size_cnt = node->size_cnt;
+        *link = min;
+        /* The path went through the right pointer of the deleted node */
+        if (depth > top + 1) {
+            path[top + 1] = &min->right;
+        }
     }
-    if (ops->compare_object(object, root->object) > 0) {
-        root->right = insert_(root->right, ops, object);
-        return balance_(root);
+    rebalance_path_(path, depth);
+}
+
+/* Descend from the root looking for the given key, recording the links we
+ * pass through in path. Returns the link holding the matching node, or the
+ * (empty) link where it would be inserted if there is no such node. The
+ * returned link itself is not pushed to the path.
+ */
+static struct bstree_link **find_link_(struct bstree_link **root,
+        const struct bstree_ops *ops, const void *key,
+        struct bstree_link **path[], int *depth)
+{
+    struct bstree_link **link = root;
+    uint64_t prefix = prefix_(ops, key);
+    *depth = 0;
+    while (*link) {
+        int cmp = compare_(ops, key, prefix, *link);
+        if (cmp < 0) {
+            path[(*depth)++] = link;
+            link = &(*link)->left;
+        } else if (cmp > 0) {
+            path[(*depth)++] = link;
+            link = &(*link)->right;
+        } else {
+            break;
+        }
     }
-    /* Inserting equal key. We are not going to hold the given pointer.
-     * If it is us who manages the lifetime (the ops->free_object != NULL),
-     * we should free it.
-     */
-    root->count++;
-    if (ops->free_object) {
-        ops->free_object(object);
+    return link;
+}
+
+/* Same as find_link_, for intrusive trees */
+static struct bstree_link **find_link_intrusive_(struct bstree_root *root,
+        const struct bstree_link *key,
+        struct bstree_link **path[], int *depth)
+{
+    struct bstree_link **link = &root->link;
+    *depth = 0;
+    while (*link) {
+        int cmp = root->compare_link(key, *link);
+        COUNT_(compare_calls);
+        if (cmp < 0) {
+            path[(*depth)++] = link;
+            link = &(*link)->left;
+        } else if (cmp > 0) {
+            path[(*depth)++] = link;
+            link = &(*link)->right;
+        } else {
+            break;
+        }
     }
-    return balance_(root);
+    return link;
 }
 
-static struct bstree_node *replace_(struct bstree_node *root,
-        const struct bstree_ops *ops, void *object)
+static void insert_(struct bstree_link **root, const struct bstree_ops *ops,
+        void *object)
 {
-    if (!root) {
-        return mknode_(object);
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct bstree_link **link = find_link_(root, ops, object, path, &depth);
+    if (*link) {
+        /* Inserting equal key. We are not going to hold the given pointer.
+         * If it is us who manages the lifetime (the ops->free_object != NULL),
+         * we should free it. The shape of the tree does not change.
+         */
+        (*link)->count++;
+        (*link)->size_cnt++;
+        update_path_(path, depth);
+        if (ops->free_object) {
+            ops->free_object(object);
+        }
+        return;
     }
-    if (ops->compare_object(object, root->object) < 0) {
-        root->left = replace_(root->left, ops, object);
-        return balance_(root);
+    *link = mknode_(ops, object);
+    rebalance_path_(path, depth);
+}
+
+static void replace_(struct bstree_link **root, const struct bstree_ops *ops,
+        void *object)
+{
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct bstree_link **link = find_link_(root, ops, object, path, &depth);
+    if (*link) {
+        /* Inserting equal key. We are going to replace the existing object
+         * with the new one. We shall free the object if we have to
+         * (ops->free_object != NULL), then replace the pointer in the node.
+         */
+        if (ops->free_object) {
+            ops->free_object(node_(*link)->object);
+        }
+        node_(*link)->object = object;
+        if (ops->key_object) {
+            ((struct bstree_keyed_node *)*link)->key = ops->key_object(object);
+        }
+        return;
     }
-    if (ops->compare_object(object, root->object) > 0) {
-        root->right = replace_(root->right, ops, object);
-        return balance_(root);
+    *link = mknode_(ops, object);
+    rebalance_path_(path, depth);
+}
+
+/* Work handed over to another thread. The thread gets its own copy of the
+ * ops, and of the pool if there is one, so that the nodes it frees go to a
+ * free list of its own, which join_fork_ hands over to the pool afterwards.
+ * Nothing allocates nodes while forked.
+ */
+struct fork {
+    pthread_t thread;
+    struct bstree_ops ops;
+    struct bstree_pool pool;
+};
+
+/* Run fn(arg) on a new thread, with &fork->ops to be used there in place of
+ * ops. Returns 0 if no thread could be started.
+ */
+static int fork_(struct fork *fork, const struct bstree_ops *ops,
+        void *(*fn)(void *arg), void *arg)
+{
+    fork->ops = *ops;
+    if (ops->pool) {
+        fork->pool = *ops->pool;
+        fork->pool.free_nodes = NULL;
+        fork->ops.pool = &fork->pool;
     }
-    /* Inserting equal key. We are going to replace the existing object with
-     * the new one. We shall free the object if we have to (ops->free_object != NULL),
-     * then replace the pointer in the node.
-     */
-    if (ops->free_object) {
-        ops->free_object(root->object);
+    return pthread_create(&fork->thread, NULL, fn, arg) == 0;
+}
+
+static void join_fork_(struct fork *fork, const struct bstree_ops *ops)
+{
+    struct bstree_link *last;
+    pthread_join(fork->thread, NULL);
+    if (ops->pool && (last = fork->pool.free_nodes)) {
+        while (last->left) {
+            last = last->left;
+        }
+        last->left = ops->pool->free_nodes;
+        ops->pool->free_nodes = fork->pool.free_nodes;
     }
-    root->object = object;
-    return balance_(root);
 }
 
-static void destroy_(struct bstree_node *root, const struct bstree_ops *ops)
+static void destroy_(struct bstree_link *root, const struct bstree_ops *ops)
 {
     if (!root) {
         return;
@@ -203,22 +563,203 @@ static void destroy_(struct bstree_node *root, const struct bstree_ops *ops)
     destroy_(root->left, ops);
     destroy_(root->right, ops);
     if (ops->free_object) {
-        ops->free_object(root->object);
+        ops->free_object(node_(root)->object);
+    }
+    free_node_(ops, root);
+}
+
+/* Pooled trees do not need to give their nodes back one by one, only the
+ * objects have to be visited, and only if we own them.
+ */
+static void free_objects_(struct bstree_link *root,
+        const struct bstree_ops *ops)
+{
+    if (!root) {
+        return;
+    }
+    free_objects_(root->left, ops);
+    free_objects_(root->right, ops);
+    ops->free_object(node_(root)->object);
+}
+
+struct destroy_task {
+    struct fork fork;
+    struct bstree_link *root;
+    int threads;
+    int nodes;
+};
+
+static void destroy_parallel_(struct bstree_link *root,
+        const struct bstree_ops *ops, int threads, int nodes);
+
+static void *run_destroy_task_(void *arg)
+{
+    struct destroy_task *task = arg;
+    destroy_parallel_(task->root, &task->fork.ops, task->threads,
+            task->nodes);
+    return NULL;
+}
+
+/* Same as destroy_ if nodes is set, as free_objects_ otherwise, using up to
+ * the given number of threads.
+ */
+static void destroy_parallel_(struct bstree_link *root,
+        const struct bstree_ops *ops, int threads, int nodes)
+{
+    struct destroy_task task;
+    if (threads > 1 && size_(root) >= 2 * PARALLEL_GRAIN) {
+        task.root = root->left;
+        task.threads = threads / 2;
+        task.nodes = nodes;
+        if (fork_(&task.fork, ops, run_destroy_task_, &task)) {
+            destroy_parallel_(root->right, ops, threads - threads / 2, nodes);
+            join_fork_(&task.fork, ops);
+            if (nodes) {
+                drop_(ops, root);
+            } else {
+                ops->free_object(node_(root)->object);
+            }
+            return;
+        }
+    }
+    if (nodes) {
+        destroy_(root, ops);
+    } else {
+        free_objects_(root, ops);
+    }
+}
+
+/* Link the n consecutive nodes of the chunk starting from the given one into
+ * a perfectly balanced tree, in order. Both halves of every subtree get the
+ * same number of nodes, give or take one, so their heights cannot differ by
+ * more than one either. If objects is not NULL, the nodes are given the
+ * objects at the same positions first, with a count of one.
+ */
+static struct bstree_link *build_(struct bstree_chunk *chunk, size_t first,
+        int n, const struct bstree_ops *ops, void **objects, int threads);
+
+struct build_task {
+    struct fork fork;
+    struct bstree_chunk *chunk;
+    size_t first;
+    int n;
+    void **objects;
+    int threads;
+    struct bstree_link *result;
+};
+
+static void *run_build_task_(void *arg)
+{
+    struct build_task *task = arg;
+    task->result = build_(task->chunk, task->first, task->n, &task->fork.ops,
+            task->objects, task->threads);
+    return NULL;
+}
+
+static struct bstree_link *build_(struct bstree_chunk *chunk, size_t first,
+        int n, const struct bstree_ops *ops, void **objects, int threads)
+{
+    struct bstree_node *node;
+    struct bstree_link *root;
+    struct build_task task;
+    int mid = n / 2;
+    if (n == 0) {
+        return NULL;
+    }
+    node = chunk_node_(chunk, first + mid, node_size_(ops));
+    if (objects) {
+        node->object = objects[first + mid];
+        node->link.count = 1;
+        if (ops->key_object) {
+            ((struct bstree_keyed_node *)node)->key =
+                ops->key_object(node->object);
+        }
+    }
+    root = &node->link;
+    task.chunk = chunk;
+    task.first = first;
+    task.n = mid;
+    task.objects = objects;
+    task.threads = threads / 2;
+    if (threads > 1 && n >= 2 * PARALLEL_GRAIN
+            && fork_(&task.fork, ops, run_build_task_, &task)) {
+        root->right = build_(chunk, first + mid + 1, n - mid - 1, ops,
+                objects, threads - threads / 2);
+        join_fork_(&task.fork, ops);
+        root->left = task.result;
+    } else {
+        root->left = build_(chunk, first, mid, ops, objects, threads);
+        root->right = build_(chunk, first + mid + 1, n - mid - 1, ops,
+                objects, threads);
+    }
+    update_(root);
+    return root;
+}
+
+/* Build a tree of the sorted objects out of one new chunk of the pool, and
+ * return its root.
+ */
+static struct bstree_link *build_sorted_(struct bstree_ops *ops,
+        void **objects, int n, int merge)
+{
+    struct bstree_chunk *chunk;
+    struct bstree_node *node = NULL;
+    size_t node_size = node_size_(ops);
+    int i, distinct = 0;
+    if (n == 0) {
+        return NULL;
+    }
+    if (!ops->pool) {
+        ops->pool = pool_new_(node_size);
+    }
+    if (!merge) {
+        chunk = pool_grow_(ops->pool, n);
+        chunk->used = n;
+        COUNT_N_(nodes_allocated, n);
+        return build_(chunk, 0, n, ops, objects, ops->threads);
+    }
+    for (i = 0; i < n; i++) {
+        if (i == 0 || ops->compare_object(objects[i], objects[i - 1])) {
+            distinct++;
+        }
+    }
+    /* Both passes compare every object to the one before it */
+    COUNT_N_(compare_calls, 2 * (n - 1));
+    COUNT_N_(nodes_allocated, distinct);
+    chunk = pool_grow_(ops->pool, distinct);
+    chunk->used = distinct;
+    distinct = 0;
+    for (i = 0; i < n; i++) {
+        if (node && !ops->compare_object(objects[i], node->object)) {
+            /* Same as inserting an equal key */
+            node->link.count++;
+            if (ops->free_object) {
+                ops->free_object(objects[i]);
+            }
+            continue;
+        }
+        node = chunk_node_(chunk, distinct++, node_size);
+        node->object = objects[i];
+        node->link.count = 1;
+        if (ops->key_object) {
+            ((struct bstree_keyed_node *)node)->key =
+                ops->key_object(objects[i]);
+        }
     }
-    free(root);
+    return build_(chunk, 0, distinct, ops, NULL, ops->threads);
 }
 
-static int traverse_inorder_(const struct bstree_node *root, void *it_data,
+static int traverse_inorder_(const struct bstree_link *root, void *it_data,
         int (*operation)(void *object, void *it_data))
 {
     return
         root &&
         (traverse_inorder_(root->left, it_data, operation) ||
-        operation(root->object, it_data) ||
+        operation(node_(root)->object, it_data) ||
         traverse_inorder_(root->right, it_data, operation));
 }
 
-static int traverse_inorder_cnt_(const struct bstree_node *root,
+static int traverse_inorder_cnt_(const struct bstree_link *root,
         void *it_data,
         int (*operation)(void *object, void *it_data))
 {
@@ -230,7 +771,7 @@ static int traverse_inorder_cnt_(const struct bstree_node *root,
         return 1;
     }
     for (i = 0; i < root->count; i++) {
-        if (operation(root->object, it_data)) {
+        if (operation(node_(root)->object, it_data)) {
             return 1;
         }
     }
@@ -240,149 +781,1548 @@ static int traverse_inorder_cnt_(const struct bstree_node *root,
     return 0;
 }
 
-static int count_(const struct bstree_node *root,
-        const struct bstree_ops *ops, const void *object)
+/* Traverse the nodes with keys in [lo, hi), a NULL bound meaning no bound.
+ * Subtrees completely out of the range are never entered, and once a subtree
+ * is known to be on the right side of a bound, that bound is dropped for it,
+ * so only O(log n) comparisons are made in total.
+ */
+static int traverse_range_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *lo, uint64_t lo_prefix,
+        const void *hi, uint64_t hi_prefix, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
 {
+    int i, ge_lo, lt_hi;
     if (!root) {
         return 0;
     }
-    if (ops->compare_object(object, root->object) < 0) {
-        return count_(root->left, ops, object);
+    ge_lo = !lo || compare_(ops, lo, lo_prefix, root) <= 0;
+    lt_hi = !hi || compare_(ops, hi, hi_prefix, root) > 0;
+    if (ge_lo && traverse_range_(root->left, ops, lo, lo_prefix,
+                lt_hi ? NULL : hi, hi_prefix, it_data, operation, cnt)) {
+        return 1;
     }
-    if (ops->compare_object(object, root->object) > 0) {
-        return count_(root->right, ops, object);
+    if (ge_lo && lt_hi) {
+        for (i = 0; i < (cnt ? root->count : 1); i++) {
+            if (operation(node_(root)->object, it_data)) {
+                return 1;
+            }
+        }
     }
-    return root->count;
+    return lt_hi && traverse_range_(root->right, ops, ge_lo ? NULL : lo,
+            lo_prefix, hi, hi_prefix, it_data, operation, cnt);
 }
 
-static void *search_(const struct bstree_node *root,
-        const struct bstree_ops *ops, const void *key)
+/* Find the smallest object greater than the key, or equal to it as well if
+ * not strict.
+ */
+static void *bound_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *key, int strict)
 {
-    if (!root) {
-        return NULL;
-    }
-    if (ops->compare_object(key, root->object) < 0) {
-        return search_(root->left, ops, key);
-    }
-    if (ops->compare_object(key, root->object) > 0) {
-        return search_(root->right, ops, key);
+    void *found = NULL;
+    uint64_t prefix = prefix_(ops, key);
+    while (root) {
+        int cmp = compare_(ops, key, prefix, root);
+        if (cmp < 0 || (cmp == 0 && !strict)) {
+            found = node_(root)->object;
+            if (cmp == 0) {
+                break;
+            }
+            root = root->left;
+        } else {
+            root = root->right;
+        }
     }
-    return root->object;
+    return found;
 }
 
-static struct bstree_node *remove_(struct bstree_node *root,
-        const struct bstree_ops *ops, const void *key)
+/* Backends keep no subtree sizes, so the order queries of their trees walk
+ * them in order instead, with the state below as it_data, counting the
+ * objects (or their copies) passed until the one asked for.
+ */
+struct order_walk {
+    const struct bstree_ops *ops;
+    /* The key ranked or bounded, or the position of the object selected */
+    const void *key;
+    /* For bounds, 1 to stop at an object equal to the key, 0 not to */
+    long k;
+    long seen;
+    void *object;
+};
+
+static int rank_step_(void *object, void *it_data)
 {
-    if (!root) {
-        return NULL;
-    }
-    if (ops->compare_object(key, root->object) < 0) {
-         root->left = remove_(root->left, ops, key);
-         return balance_(root);
-    }
-    if (ops->compare_object(key, root->object) > 0) {
-        root->right = remove_(root->right, ops, key);
-        return balance_(root);
-    }
-    /* Found the node to be deleted */
-    if (!root->left || !root->right) {
-        struct bstree_node *tmp = root->left ? root->left : root->right;
-        if (ops->free_object) {
-            ops->free_object(root->object);
-        }
-        free(root);
-        return tmp;
-    }
-    /* Node to be deleted has two children */
-    struct bstree_node *right_min = get_min_(root->right);
-    /* As we get the pointer held at right_min and put it inside root, we shall
-     * remove right_min without free'ing the object it holds.
-     * For this reason, we call the remove function with a NULL free_object.
-     */
-    struct bstree_ops tmp_ops = *ops;
-    tmp_ops.free_object = NULL;
-    if (ops->free_object) {
-        ops->free_object(root->object);
+    struct order_walk *w = it_data;
+    COUNT_(compare_calls);
+    if (w->ops->compare_object(w->key, object) <= 0) {
+        return 1;
     }
-    root->object = right_min->object;
-    root->right = remove_(root->right, &tmp_ops, right_min->object);
-    return balance_(root);
+    w->seen++;
+    return 0;
 }
 
-static int size_(struct bstree_node *root)
+static int select_step_(void *object, void *it_data)
 {
-    if (!root) {
-        return 0;
+    struct order_walk *w = it_data;
+    if (w->seen++ == w->k) {
+        w->object = object;
+        return 1;
     }
-    return size_(root->left) + size_(root->right) + 1;
+    return 0;
 }
 
-/* Interface functions
- */
-
-struct bstree *bstree_new(
-        int (*compare_object)(const void *lhs, const void *rhs),
-        void (*free_object)(void *object))
+static int bound_step_(void *object, void *it_data)
 {
-    struct bstree *tree;
-    tree = malloc(sizeof(*tree));
-    tree->root = NULL;
-    tree->ops = malloc(sizeof(*tree->ops));
-    tree->ops->compare_object = compare_object;
-    tree->ops->free_object = free_object;
-    return tree;
+    struct order_walk *w = it_data;
+    COUNT_(compare_calls);
+    if (w->ops->compare_object(w->key, object) < w->k) {
+        w->object = object;
+        return 1;
+    }
+    return 0;
 }
 
-void bstree_destroy(struct bstree *tree)
+static long backend_rank_(const struct bstree *tree, const void *key, int cnt)
 {
-    destroy_(tree->root, tree->ops);
-    free(tree->ops);
-    free(tree);
+    struct order_walk w = { tree->ops, key, 0, 0, NULL };
+    tree->ops->backend->traverse(tree, &w, rank_step_, cnt);
+    return w.seen;
 }
 
-void bstree_insert(struct bstree *tree, void *object)
+static void *backend_select_(const struct bstree *tree, long k, int cnt)
 {
-    tree->root = insert_(tree->root, tree->ops, object);
+    struct order_walk w = { tree->ops, NULL, k, 0, NULL };
+    if (k >= 0) {
+        tree->ops->backend->traverse(tree, &w, select_step_, cnt);
+    }
+    return w.object;
 }
 
-void bstree_replace(struct bstree *tree, void *object)
+/* Like bound_, for backend trees, starting from the key for those which
+ * support range traversals.
+ */
+static void *backend_bound_(const struct bstree *tree, const void *key,
+        int strict)
 {
-    tree->root = replace_(tree->root, tree->ops, object);
+    struct order_walk w = { tree->ops, key, !strict, 0, NULL };
+    const struct bstree_backend *backend = tree->ops->backend;
+    if (backend->traverse_range) {
+        backend->traverse_range(tree, key, NULL, &w, bound_step_, 0);
+    } else {
+        backend->traverse(tree, &w, bound_step_, 0);
+    }
+    return w.object;
 }
 
-int bstree_traverse_inorder(const struct bstree *tree, void *it_data,
-        int (*operation)(void *object, void *it_data))
+static int traverse_links_(struct bstree_link *root, void *it_data,
+        int (*operation)(struct bstree_link *link, void *it_data))
 {
-    return traverse_inorder_(tree->root, it_data, operation);
+    return
+        root &&
+        (traverse_links_(root->left, it_data, operation) ||
+        operation(root, it_data) ||
+        traverse_links_(root->right, it_data, operation));
 }
 
-int bstree_traverse_inorder_cnt(const struct bstree *tree, void *it_data,
-        int (*operation)(void *object, void *it_data))
+static const struct bstree_link *find_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *key)
 {
-    return traverse_inorder_cnt_(tree->root, it_data, operation);
+    uint64_t prefix = prefix_(ops, key);
+    while (root) {
+        int cmp = compare_(ops, key, prefix, root);
+        if (cmp < 0) {
+            root = root->left;
+        } else if (cmp > 0) {
+            root = root->right;
+        } else {
+            break;
+        }
+    }
+    return root;
+}
+
+static int count_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *key)
+{
+    const struct bstree_link *node = find_(root, ops, key);
+    return node ? node->count : 0;
+}
+
+static void *search_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *key)
+{
+    const struct bstree_link *node = find_(root, ops, key);
+    return node ? node_(node)->object : NULL;
+}
+
+static const struct bstree_link **cache_slot_(const struct bstree_ops *ops,
+        const void *key)
+{
+    return &ops->cache->slots[ops->cache->hash_object(key) & ops->cache->mask];
+}
+
+static const struct bstree_link *find_cached_(const struct bstree *tree,
+        const void *key)
+{
+    const struct bstree_link **slot = cache_slot_(tree->ops, key);
+    const struct bstree_link *node = *slot;
+    if (node) {
+        COUNT_(compare_calls);
+        if (tree->ops->compare_object(key, node_(node)->object) == 0) {
+            tree->ops->cache->hits++;
+            return node;
+        }
+    }
+    tree->ops->cache->misses++;
+    node = find_(tree->root, tree->ops, key);
+    if (node) {
+        *slot = node;
+    }
+    return node;
+}
+
+static void cache_clear_(const struct bstree_ops *ops)
+{
+    if (ops->cache) {
+        memset(ops->cache->slots, 0,
+                (ops->cache->mask + 1) * sizeof *ops->cache->slots);
+    }
+}
+
+/* Look up the keys by descending once per level for every key still being
+ * looked up, so by the time a lookup reaches its next node, the node has
+ * been fetched while the others were compared.
+ */
+static void search_batch_(const struct bstree_link *root,
+        const struct bstree_ops *ops, const void *const *keys, int n,
+        void **out)
+{
+    const struct bstree_link *links[BATCH_WIDTH];
+    uint64_t prefixes[BATCH_WIDTH];
+    int lanes[BATCH_WIDTH];
+    int i, active;
+    for (i = 0; i < n; i++) {
+        prefixes[i] = prefix_(ops, keys[i]);
+        links[i] = root;
+        lanes[i] = i;
+        out[i] = NULL;
+    }
+    active = root ? n : 0;
+    while (active > 0) {
+        int j = 0;
+        for (i = 0; i < active; i++) {
+            int lane = lanes[i];
+            const struct bstree_link *link = links[lane];
+            int cmp = compare_(ops, keys[lane], prefixes[lane], link);
+            if (cmp == 0) {
+                out[lane] = node_(link)->object;
+                continue;
+            }
+            link = cmp < 0 ? link->left : link->right;
+            if (link) {
+                __builtin_prefetch(link);
+                links[lane] = link;
+                lanes[j++] = lane;
+            }
+        }
+        active = j;
+    }
+}
+
+static void remove_(struct bstree_link **root, const struct bstree_ops *ops,
+        const void *key)
+{
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct bstree_link **link = find_link_(root, ops, key, path, &depth);
+    struct bstree_link *node = *link;
+    if (!node) {
+        return;
+    }
+    /* Found the node to be deleted */
+    if (ops->free_object) {
+        ops->free_object(node_(node)->object);
+    }
+    unlink_(path, depth, link);
+    free_node_(ops, node);
+}
+
+/* Interface functions
+ */
+
+/* Objects and counts of a tree in order, for bstree_gather */
+struct gather {
+    void **objects;
+    int *counts;
+    int n;
+    int capacity;
+    /* Set when the arrays could not be grown */
+    int failed;
+};
+
+/* Append an object to the arrays, doubling them when full. A tree shared
+ * between threads may grow after we sized them, so its size is only a hint.
+ */
+static int gather_push_(struct gather *g, void *object, int count)
+{
+    if (g->n == g->capacity) {
+        void **objects = realloc(g->objects,
+                2 * g->capacity * sizeof *g->objects);
+        int *counts = objects ?
+            realloc(g->counts, 2 * g->capacity * sizeof *g->counts) : NULL;
+        if (objects) {
+            g->objects = objects;
+        }
+        if (!counts) {
+            g->failed = 1;
+            return 1;
+        }
+        g->counts = counts;
+        g->capacity *= 2;
+    }
+    g->objects[g->n] = object;
+    g->counts[g->n++] = count;
+    return 0;
+}
+
+static void gather_links_(const struct bstree_link *root, struct gather *g)
+{
+    if (root && !g->failed) {
+        gather_links_(root->left, g);
+        gather_push_(g, node_(root)->object, root->count);
+        gather_links_(root->right, g);
+    }
+}
+
+/* Backends only let us traverse every object count times in a row */
+static int gather_object_(void *object, void *it_data)
+{
+    struct gather *g = it_data;
+    if (g->n > 0 && g->objects[g->n - 1] == object) {
+        g->counts[g->n - 1]++;
+        return 0;
+    }
+    return gather_push_(g, object, 1);
+}
+
+/* Traverse the nodes whose positions in order, counting from 0, are in
+ * [lo, hi), skipping the subtrees outside by their sizes.
+ */
+static int traverse_positions_(const struct bstree_link *root, int lo, int hi,
+        void *it_data, int (*operation)(void *object, void *it_data))
+{
+    int left;
+    if (!root || hi <= 0 || lo >= root->size) {
+        return 0;
+    }
+    left = size_(root->left);
+    return
+        (lo < left &&
+         traverse_positions_(root->left, lo, hi, it_data, operation)) ||
+        (lo <= left && left < hi &&
+         operation(node_(root)->object, it_data)) ||
+        traverse_positions_(root->right, lo - left - 1, hi - left - 1,
+                it_data, operation);
+}
+
+/* The part of the tree one thread of bstree_parallel_for_each visits */
+struct for_each_task {
+    pthread_t thread;
+    int started;
+    const struct bstree_link *root;
+    int lo;
+    int hi;
+    void *acc;
+    int (*operation)(void *object, void *it_data);
+};
+
+static void *run_for_each_task_(void *arg)
+{
+    struct for_each_task *task = arg;
+    traverse_positions_(task->root, task->lo, task->hi, task->acc,
+            task->operation);
+    return NULL;
+}
+
+/* Join, split and set operations, along the lines of "Just Join for
+ * Parallel Ordered Sets" by Blelloch, Ferizovic and Sun.
+ */
+
+/* Return the tree made of the nodes of left, then mid, then the nodes of
+ * right, everything in left being less than mid and everything in right
+ * greater. Going down the taller side until meeting a subtree about as tall
+ * as the other side, the cost is proportional to the difference in heights.
+ */
+static struct bstree_link *join_(struct bstree_link *left,
+        struct bstree_link *mid, struct bstree_link *right)
+{
+    if (height_(left) > height_(right) + MAX_IMBALANCE) {
+        left->right = join_(left->right, mid, right);
+        return balance_(left);
+    }
+    if (height_(right) > height_(left) + MAX_IMBALANCE) {
+        right->left = join_(left, mid, right->left);
+        return balance_(right);
+    }
+    mid->left = left;
+    mid->right = right;
+    update_(mid);
+    return mid;
+}
+
+/* Detach the minimum of the given non empty tree into *min, returning what
+ * is left.
+ */
+static struct bstree_link *split_min_(struct bstree_link *root,
+        struct bstree_link **min)
+{
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = split_min_(root->left, min);
+    return balance_(root);
+}
+
+/* Same as join_, without a node in the middle.
+ */
+static struct bstree_link *join2_(struct bstree_link *left,
+        struct bstree_link *right)
+{
+    struct bstree_link *min;
+    if (!right) {
+        return left;
+    }
+    right = split_min_(right, &min);
+    return join_(left, min, right);
+}
+
+/* Split the tree into the nodes less than the key, in *left, and the ones
+ * greater, in *right, returning the node matching the key, if any, detached
+ * from both.
+ */
+static struct bstree_link *split_(struct bstree_link *root,
+        const struct bstree_ops *ops, const void *key, uint64_t prefix,
+        struct bstree_link **left, struct bstree_link **right)
+{
+    struct bstree_link *found, *sub;
+    int cmp;
+    if (!root) {
+        *left = NULL;
+        *right = NULL;
+        return NULL;
+    }
+    cmp = compare_(ops, key, prefix, root);
+    if (cmp == 0) {
+        *left = root->left;
+        *right = root->right;
+        return root;
+    }
+    if (cmp < 0) {
+        found = split_(root->left, ops, key, prefix, left, &sub);
+        *right = join_(sub, root, root->right);
+    } else {
+        found = split_(root->right, ops, key, prefix, &sub, right);
+        *left = join_(root->left, root, sub);
+    }
+    return found;
+}
+
+/* The prefix of the object of the node, as prefix_ would compute it.
+ */
+static uint64_t node_prefix_(const struct bstree_ops *ops,
+        const struct bstree_link *link)
+{
+    return ops->key_object ? key_(link) : 0;
+}
+
+/* In the set operations, a holds the nodes of the tree being modified, and b
+ * the ones of the other tree. Splitting b by the root of a, the two halves
+ * of each can be combined independently, and in parallel, see set_op_pair_.
+ */
+struct set_task {
+    struct fork fork;
+    struct bstree_link *(*op)(struct bstree_link *a, struct bstree_link *b,
+            const struct bstree_ops *ops, int threads);
+    struct bstree_link *a;
+    struct bstree_link *b;
+    int threads;
+    struct bstree_link *result;
+};
+
+static void *run_set_task_(void *arg)
+{
+    struct set_task *task = arg;
+    task->result = task->op(task->a, task->b, &task->fork.ops, task->threads);
+    return NULL;
+}
+
+/* Set *left to op(a->left, left) and *right to op(a->right, right), on two
+ * threads if there are threads to spare and enough work for both.
+ */
+static void set_op_pair_(struct bstree_link *(*op)(struct bstree_link *a,
+            struct bstree_link *b, const struct bstree_ops *ops, int threads),
+        const struct bstree_link *a, struct bstree_link **left,
+        struct bstree_link **right, const struct bstree_ops *ops,
+        int threads)
+{
+    struct set_task task;
+    task.op = op;
+    task.a = a->left;
+    task.b = *left;
+    task.threads = threads / 2;
+    if (threads > 1
+            && size_(a->left) + size_(*left) >= PARALLEL_GRAIN
+            && size_(a->right) + size_(*right) >= PARALLEL_GRAIN
+            && fork_(&task.fork, ops, run_set_task_, &task)) {
+        *right = op(a->right, *right, ops, threads - threads / 2);
+        join_fork_(&task.fork, ops);
+        *left = task.result;
+    } else {
+        *left = op(a->left, *left, ops, threads);
+        *right = op(a->right, *right, ops, threads);
+    }
+}
+
+static struct bstree_link *union_(struct bstree_link *a, struct bstree_link *b,
+        const struct bstree_ops *ops, int threads)
+{
+    struct bstree_link *found, *left, *right;
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    found = split_(b, ops, node_(a)->object, node_prefix_(ops, a),
+            &left, &right);
+    set_op_pair_(union_, a, &left, &right, ops, threads);
+    if (found) {
+        /* Same as inserting an equal key */
+        a->count += found->count;
+        drop_(ops, found);
+    }
+    return join_(left, a, right);
+}
+
+static struct bstree_link *intersect_(struct bstree_link *a,
+        struct bstree_link *b, const struct bstree_ops *ops, int threads)
+{
+    struct bstree_link *found, *left, *right;
+    if (!a || !b) {
+        destroy_(a, ops);
+        destroy_(b, ops);
+        return NULL;
+    }
+    found = split_(b, ops, node_(a)->object, node_prefix_(ops, a),
+            &left, &right);
+    set_op_pair_(intersect_, a, &left, &right, ops, threads);
+    if (!found) {
+        drop_(ops, a);
+        return join2_(left, right);
+    }
+    if (found->count < a->count) {
+        a->count = found->count;
+    }
+    drop_(ops, found);
+    return join_(left, a, right);
+}
+
+static struct bstree_link *difference_(struct bstree_link *a,
+        struct bstree_link *b, const struct bstree_ops *ops, int threads)
+{
+    struct bstree_link *found, *left, *right;
+    if (!a || !b) {
+        destroy_(b, ops);
+        return a;
+    }
+    found = split_(b, ops, node_(a)->object, node_prefix_(ops, a),
+            &left, &right);
+    set_op_pair_(difference_, a, &left, &right, ops, threads);
+    if (found && found->count >= a->count) {
+        drop_(ops, found);
+        drop_(ops, a);
+        return join2_(left, right);
+    }
+    if (found) {
+        a->count -= found->count;
+        drop_(ops, found);
+    }
+    return join_(left, a, right);
+}
+
+/* Remove the nodes matching any of the n sorted keys from the tree, and
+ * return what is left. The keys are split by the root the way the set
+ * operations split the other tree, so untouched subtrees are not visited,
+ * and the tree is only rebalanced where the remaining parts are joined.
+ */
+static struct bstree_link *remove_sorted_(struct bstree_link *root,
+        const struct bstree_ops *ops, const void *const *keys, int n)
+{
+    struct bstree_link *left, *right;
+    int lo = 0, hi = n, found;
+    if (!root || n == 0) {
+        return root;
+    }
+    /* Find the first key not less than the object of the root */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (compare_(ops, keys[mid], prefix_(ops, keys[mid]), root) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    found = lo < n && compare_(ops, keys[lo], prefix_(ops, keys[lo]), root)
+        == 0;
+    left = remove_sorted_(root->left, ops, keys, lo);
+    right = remove_sorted_(root->right, ops, keys + lo + found,
+            n - lo - found);
+    if (found) {
+        drop_(ops, root);
+        return join2_(left, right);
+    }
+    return join_(left, root, right);
+}
+
+/* Copy the nodes of a tree allocated as from says into nodes allocated as to
+ * says, keeping the shape of the tree, and free the old ones.
+ */
+static struct bstree_link *copy_nodes_(const struct bstree_ops *to,
+        const struct bstree_ops *from, struct bstree_link *root)
+{
+    struct bstree_link *copy;
+    if (!root) {
+        return NULL;
+    }
+    copy = mknode_(to, node_(root)->object);
+    copy->left = copy_nodes_(to, from, root->left);
+    copy->right = copy_nodes_(to, from, root->right);
+    copy->count = root->count;
+    copy->height = root->height;
+    copy->size = root->size;
+    copy->size_cnt = root->size_cnt;
+    free_node_(from, root);
+    return copy;
+}
+
+/* Take all the nodes out of src, so that they can be linked into dst. As
+ * the nodes have to be freed the way dst frees its own, the chunks of src are
+ * handed over to dst if both are pooled, and the nodes are copied if the two
+ * allocate their nodes differently otherwise.
+ */
+static struct bstree_link *take_nodes_(struct bstree *dst, struct bstree *src)
+{
+    struct bstree_pool *to = dst->ops->pool, *from = src->ops->pool;
+    struct bstree_link *root = src->root;
+    src->root = NULL;
+    if (to == from) {
+        return root;
+    }
+    if (!to || !from || from->users > 1) {
+        return copy_nodes_(dst->ops, src->ops, root);
+    }
+    if (from->chunks) {
+        /* Keep allocating from the current chunk of dst */
+        struct bstree_chunk *last = from->chunks;
+        while (last->next) {
+            last = last->next;
+        }
+        if (to->chunks) {
+            last->next = to->chunks->next;
+            to->chunks->next = from->chunks;
+        } else {
+            to->chunks = from->chunks;
+        }
+        from->chunks = NULL;
+    }
+    if (from->free_nodes) {
+        struct bstree_link *last = from->free_nodes;
+        while (last->left) {
+            last = last->left;
+        }
+        last->left = to->free_nodes;
+        to->free_nodes = from->free_nodes;
+        from->free_nodes = NULL;
+    }
+    return root;
+}
+
+struct bstree *bstree_new(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree;
+    tree = malloc(sizeof(*tree));
+    tree->root = NULL;
+    tree->ops = malloc(sizeof(*tree->ops));
+    tree->ops->compare_object = compare_object;
+    tree->ops->free_object = free_object;
+    tree->ops->key_object = NULL;
+    tree->ops->pool = NULL;
+    tree->ops->backend = NULL;
+    tree->ops->impl = NULL;
+    tree->ops->threads = 1;
+    tree->ops->cache = NULL;
+    return tree;
+}
+
+struct bstree *bstree_new_pooled(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, free_object);
+    tree->ops->pool = pool_new_(node_size_(tree->ops));
+    return tree;
+}
+
+struct bstree *bstree_new_keyed(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object),
+        uint64_t (*key_object)(const void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, free_object);
+    tree->ops->key_object = key_object;
+    return tree;
+}
+
+uint64_t bstree_str_prefix(const char *str)
+{
+    uint64_t prefix = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        prefix <<= 8;
+        if (*str) {
+            prefix |= (unsigned char)*str++;
+        }
+    }
+    return prefix;
+}
+
+void bstree_destroy(struct bstree *tree)
+{
+    if (tree->ops->backend) {
+        tree->ops->backend->destroy(tree);
+    } else if (tree->ops->pool && tree->ops->pool->users > 1) {
+        /* Other trees still allocate from the pool */
+        destroy_parallel_(tree->root, tree->ops, tree->ops->threads, 1);
+        pool_destroy_(tree->ops->pool);
+    } else if (tree->ops->pool) {
+        if (tree->ops->free_object) {
+            destroy_parallel_(tree->root, tree->ops, tree->ops->threads, 0);
+        }
+        /* The nodes go away with the chunks */
+        COUNT_N_(nodes_freed, size_(tree->root));
+        pool_destroy_(tree->ops->pool);
+    } else {
+        destroy_parallel_(tree->root, tree->ops, tree->ops->threads, 1);
+    }
+    free(tree->ops->cache);
+    free(tree->ops);
+    free(tree);
+}
+
+/* Backend trees get the objects one by one, and those already holding
+ * objects get the new ones merged in like bstree_union does, after moving
+ * their nodes to the pool if they had none.
+ */
+static void build_into_(struct bstree *tree, void **objects, int n,
+        int merge)
+{
+    struct bstree_ops unpooled = *tree->ops;
+    struct bstree_link *root;
+    int i;
+    if (tree->ops->backend) {
+        for (i = 0; i < n; i++) {
+            tree->ops->backend->insert(tree, objects[i]);
+        }
+        return;
+    }
+    root = build_sorted_(tree->ops, objects, n, merge);
+    if (tree->root) {
+        if (!unpooled.pool && tree->ops->pool) {
+            tree->root = copy_nodes_(tree->ops, &unpooled, tree->root);
+        }
+        cache_clear_(tree->ops);
+        tree->root = union_(tree->root, root, tree->ops, tree->ops->threads);
+    } else {
+        tree->root = root;
+    }
+}
+
+void bstree_build_sorted(struct bstree *tree, void **objects, int n)
+{
+    build_into_(tree, objects, n, 0);
+}
+
+void bstree_build_sorted_cnt(struct bstree *tree, void **objects, int n)
+{
+    build_into_(tree, objects, n, 1);
+}
+
+void bstree_set_threads(struct bstree *tree, int threads)
+{
+    tree->ops->threads = threads > 1 ? threads : 1;
+}
+
+void bstree_set_cache(struct bstree *tree, int slots,
+        uint64_t (*hash_object)(const void *object))
+{
+    size_t size = 1;
+    free(tree->ops->cache);
+    tree->ops->cache = NULL;
+    if (slots <= 0 || tree->ops->backend) {
+        return;
+    }
+    while (size < (size_t)slots) {
+        size *= 2;
+    }
+    tree->ops->cache = malloc(sizeof *tree->ops->cache +
+            size * sizeof *tree->ops->cache->slots);
+    tree->ops->cache->hash_object = hash_object;
+    tree->ops->cache->mask = size - 1;
+    tree->ops->cache->hits = 0;
+    tree->ops->cache->misses = 0;
+    cache_clear_(tree->ops);
+}
+
+void bstree_cache_stats(const struct bstree *tree, long *hits, long *misses)
+{
+    *hits = tree->ops->cache ? tree->ops->cache->hits : 0;
+    *misses = tree->ops->cache ? tree->ops->cache->misses : 0;
+}
+
+void bstree_join(struct bstree *tree, struct bstree *right)
+{
+    if (tree->ops->backend || right->ops->backend) {
+        return;
+    }
+    cache_clear_(right->ops);
+    tree->root = join2_(tree->root, take_nodes_(tree, right));
+}
+
+void bstree_split(struct bstree *tree, const void *key, struct bstree *right)
+{
+    struct bstree_link *found, *left, *rest;
+    if (tree->ops->backend || right->ops->backend) {
+        return;
+    }
+    cache_clear_(tree->ops);
+    cache_clear_(right->ops);
+    /* The nodes moved to right stay where they were allocated */
+    if (right->ops->pool != tree->ops->pool) {
+        if (right->ops->pool) {
+            pool_destroy_(right->ops->pool);
+        }
+        right->ops->pool = tree->ops->pool;
+        if (right->ops->pool) {
+            right->ops->pool->users++;
+        }
+    }
+    found = split_(tree->root, tree->ops, key, prefix_(tree->ops, key),
+            &left, &rest);
+    tree->root = left;
+    right->root = found ? join_(NULL, found, rest) : rest;
+}
+
+void bstree_union(struct bstree *tree, struct bstree *other)
+{
+    if (tree->ops->backend || other->ops->backend) {
+        return;
+    }
+    cache_clear_(tree->ops);
+    cache_clear_(other->ops);
+    tree->root = union_(tree->root, take_nodes_(tree, other), tree->ops,
+            tree->ops->threads);
+}
+
+void bstree_intersect(struct bstree *tree, struct bstree *other)
+{
+    if (tree->ops->backend || other->ops->backend) {
+        return;
+    }
+    cache_clear_(tree->ops);
+    cache_clear_(other->ops);
+    tree->root = intersect_(tree->root, take_nodes_(tree, other), tree->ops,
+            tree->ops->threads);
+}
+
+void bstree_difference(struct bstree *tree, struct bstree *other)
+{
+    if (tree->ops->backend || other->ops->backend) {
+        return;
+    }
+    cache_clear_(tree->ops);
+    cache_clear_(other->ops);
+    tree->root = difference_(tree->root, take_nodes_(tree, other),
+            tree->ops, tree->ops->threads);
+}
+
+void bstree_insert(struct bstree *tree, void *object)
+{
+    if (tree->ops->backend) {
+        tree->ops->backend->insert(tree, object);
+        return;
+    }
+    insert_(&tree->root, tree->ops, object);
+}
+
+void bstree_replace(struct bstree *tree, void *object)
+{
+    if (tree->ops->backend) {
+        tree->ops->backend->replace(tree, object);
+        return;
+    }
+    if (tree->ops->cache) {
+        *cache_slot_(tree->ops, object) = NULL;
+    }
+    replace_(&tree->root, tree->ops, object);
+}
+
+void *bstree_find_or_insert(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key))
+{
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    struct bstree_link **link;
+    void *object;
+    int depth;
+    if (tree->ops->backend) {
+        if (!tree->ops->backend->find_or_insert) {
+            return NULL;
+        }
+        return tree->ops->backend->find_or_insert(tree, key, make_object);
+    }
+    link = find_link_(&tree->root, tree->ops, key, path, &depth);
+    if (*link) {
+        return node_(*link)->object;
+    }
+    object = make_object(key);
+    *link = mknode_(tree->ops, object);
+    rebalance_path_(path, depth);
+    return object;
+}
+
+int bstree_traverse_inorder(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    if (tree->ops->backend) {
+        return tree->ops->backend->traverse(tree, it_data, operation, 0);
+    }
+    return traverse_inorder_(tree->root, it_data, operation);
+}
+
+int bstree_traverse_inorder_cnt(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    if (tree->ops->backend) {
+        return tree->ops->backend->traverse(tree, it_data, operation, 1);
+    }
+    return traverse_inorder_cnt_(tree->root, it_data, operation);
+}
+
+int bstree_gather(const struct bstree *tree, void ***objects, int **counts)
+{
+    struct gather g;
+    g.capacity = bstree_size((struct bstree *)tree) + 1;
+    g.objects = malloc(g.capacity * sizeof *g.objects);
+    g.counts = malloc(g.capacity * sizeof *g.counts);
+    g.n = 0;
+    g.failed = !g.objects || !g.counts;
+    if (!g.failed && tree->ops->backend) {
+        tree->ops->backend->traverse(tree, &g, gather_object_, 1);
+    } else {
+        gather_links_(tree->root, &g);
+    }
+    if (g.failed) {
+        free(g.objects);
+        free(g.counts);
+        return -1;
+    }
+    *objects = g.objects;
+    *counts = g.counts;
+    return g.n;
+}
+
+void bstree_read_only_insert(struct bstree *tree, void *object)
+{
+    (void)tree;
+    (void)object;
+}
+
+void bstree_read_only_remove(struct bstree *tree, const void *key)
+{
+    (void)tree;
+    (void)key;
+}
+
+int bstree_traverse_range(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    const struct bstree_ops *ops = tree->ops;
+    if (ops->backend) {
+        return ops->backend->traverse_range ?
+            ops->backend->traverse_range(tree, lo, hi, it_data, operation, 0)
+            : 0;
+    }
+    return traverse_range_(tree->root, ops, lo, lo ? prefix_(ops, lo) : 0,
+            hi, hi ? prefix_(ops, hi) : 0, it_data, operation, 0);
+}
+
+int bstree_traverse_range_cnt(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data))
+{
+    const struct bstree_ops *ops = tree->ops;
+    if (ops->backend) {
+        return ops->backend->traverse_range ?
+            ops->backend->traverse_range(tree, lo, hi, it_data, operation, 1)
+            : 0;
+    }
+    return traverse_range_(tree->root, ops, lo, lo ? prefix_(ops, lo) : 0,
+            hi, hi ? prefix_(ops, hi) : 0, it_data, operation, 1);
+}
+
+void bstree_parallel_for_each(const struct bstree *tree, int threads,
+        void **accs, int (*operation)(void *object, void *it_data),
+        void (*combine)(void *acc, void *other))
+{
+    struct for_each_task *tasks;
+    int size, i;
+    threads = threads > 1 ? threads : 1;
+    tasks = tree->ops->backend ? NULL : malloc(threads * sizeof *tasks);
+    if (!tasks) {
+        /* Backends, and running out of memory, visit everything serially */
+        bstree_traverse_inorder(tree, accs[0], operation);
+        for (i = 1; i < threads && combine; i++) {
+            combine(accs[0], accs[i]);
+        }
+        return;
+    }
+    size = size_(tree->root);
+    for (i = 0; i < threads; i++) {
+        tasks[i].root = tree->root;
+        tasks[i].lo = (long)size * i / threads;
+        tasks[i].hi = (long)size * (i + 1) / threads;
+        tasks[i].acc = accs[i];
+        tasks[i].operation = operation;
+    }
+    /* The calling thread takes the first part */
+    for (i = 1; i < threads; i++) {
+        tasks[i].started = !pthread_create(&tasks[i].thread, NULL,
+                run_for_each_task_, &tasks[i]);
+        if (!tasks[i].started) {
+            run_for_each_task_(&tasks[i]);
+        }
+    }
+    run_for_each_task_(&tasks[0]);
+    for (i = 1; i < threads; i++) {
+        if (tasks[i].started) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+        if (combine) {
+            combine(accs[0], accs[i]);
+        }
+    }
+    free(tasks);
+}
+
+void *bstree_lower_bound(const struct bstree *tree, const void *key)
+{
+    if (tree->ops->backend) {
+        return backend_bound_(tree, key, 0);
+    }
+    return bound_(tree->root, tree->ops, key, 0);
+}
+
+void *bstree_upper_bound(const struct bstree *tree, const void *key)
+{
+    if (tree->ops->backend) {
+        return backend_bound_(tree, key, 1);
+    }
+    return bound_(tree->root, tree->ops, key, 1);
 }
 
 int bstree_count(const struct bstree *tree, const void *key)
 {
+    if (tree->ops->backend) {
+        return tree->ops->backend->count(tree, key);
+    }
+    if (tree->ops->cache) {
+        const struct bstree_link *node = find_cached_(tree, key);
+        return node ? node->count : 0;
+    }
     return count_(tree->root, tree->ops, key);
 }
 
 void *bstree_search(const struct bstree *tree, const void *key)
 {
+    if (tree->ops->backend) {
+        return tree->ops->backend->search(tree, key);
+    }
+    if (tree->ops->cache) {
+        const struct bstree_link *node = find_cached_(tree, key);
+        return node ? node_(node)->object : NULL;
+    }
     return search_(tree->root, tree->ops, key);
 }
 
+void bstree_search_batch(const struct bstree *tree, const void *const *keys,
+        int n, void **out)
+{
+    int i;
+    if (tree->ops->backend) {
+        for (i = 0; i < n; i++) {
+            out[i] = tree->ops->backend->search(tree, keys[i]);
+        }
+        return;
+    }
+    for (i = 0; i < n; i += BATCH_WIDTH) {
+        int width = n - i < BATCH_WIDTH ? n - i : BATCH_WIDTH;
+        search_batch_(tree->root, tree->ops, keys + i, width, out + i);
+    }
+}
+
 void bstree_remove(struct bstree *tree, const void *key)
 {
-    tree->root = remove_(tree->root, tree->ops, key);
+    if (tree->ops->backend) {
+        tree->ops->backend->remove(tree, key);
+        return;
+    }
+    if (tree->ops->cache) {
+        *cache_slot_(tree->ops, key) = NULL;
+    }
+    remove_(&tree->root, tree->ops, key);
+}
+
+void bstree_remove_batch(struct bstree *tree, const void *const *keys, int n)
+{
+    int i;
+    if (tree->ops->backend) {
+        for (i = 0; i < n; i++) {
+            tree->ops->backend->remove(tree, keys[i]);
+        }
+        return;
+    }
+    cache_clear_(tree->ops);
+    tree->root = remove_sorted_(tree->root, tree->ops, keys, n);
 }
 
 int bstree_size(struct bstree *tree)
 {
+    if (tree->ops->backend) {
+        return tree->ops->backend->size(tree);
+    }
     return size_(tree->root);
 }
 
+long bstree_size_cnt(struct bstree *tree)
+{
+    if (tree->ops->backend) {
+        return tree->ops->backend->size_cnt(tree);
+    }
+    return size_cnt_(tree->root);
+}
+
+void *bstree_select(const struct bstree *tree, int k)
+{
+    const struct bstree_link *root = tree->root;
+    if (tree->ops->backend) {
+        return backend_select_(tree, k, 0);
+    }
+    while (root) {
+        int left = size_(root->left);
+        if (k < left) {
+            root = root->left;
+        } else if (k == left) {
+            return node_(root)->object;
+        } else {
+            k -= left + 1;
+            root = root->right;
+        }
+    }
+    return NULL;
+}
+
+void *bstree_select_cnt(const struct bstree *tree, long k)
+{
+    const struct bstree_link *root = tree->root;
+    if (tree->ops->backend) {
+        return backend_select_(tree, k, 1);
+    }
+    while (root) {
+        long left = size_cnt_(root->left);
+        if (k < left) {
+            root = root->left;
+        } else if (k < left + root->count) {
+            return node_(root)->object;
+        } else {
+            k -= left + root->count;
+            root = root->right;
+        }
+    }
+    return NULL;
+}
+
+int bstree_rank(const struct bstree *tree, const void *key)
+{
+    const struct bstree_link *root = tree->root;
+    uint64_t prefix = prefix_(tree->ops, key);
+    int rank = 0;
+    if (tree->ops->backend) {
+        return backend_rank_(tree, key, 0);
+    }
+    while (root) {
+        int cmp = compare_(tree->ops, key, prefix, root);
+        if (cmp < 0) {
+            root = root->left;
+        } else {
+            rank += size_(root->left);
+            if (cmp == 0) {
+                break;
+            }
+            rank++;
+            root = root->right;
+        }
+    }
+    return rank;
+}
+
+long bstree_rank_cnt(const struct bstree *tree, const void *key)
+{
+    const struct bstree_link *root = tree->root;
+    uint64_t prefix = prefix_(tree->ops, key);
+    long rank = 0;
+    if (tree->ops->backend) {
+        return backend_rank_(tree, key, 1);
+    }
+    while (root) {
+        int cmp = compare_(tree->ops, key, prefix, root);
+        if (cmp < 0) {
+            root = root->left;
+        } else {
+            rank += size_cnt_(root->left);
+            if (cmp == 0) {
+                break;
+            }
+            rank += root->count;
+            root = root->right;
+        }
+    }
+    return rank;
+}
+
+void *bstree_sample_weighted(const struct bstree *tree, double r)
+{
+    long total = tree->ops->backend ? tree->ops->backend->size_cnt(tree)
+        : size_cnt_(tree->root);
+    long k = r * total;
+    if (k >= total) {
+        k = total - 1;
+    }
+    return bstree_select_cnt(tree, k < 0 ? 0 : k);
+}
+
 int bstree_height(struct bstree *tree)
 {
+    if (tree->ops->backend) {
+        return tree->ops->backend->height(tree);
+    }
     return height_(tree->root);
 }
+
+/* The sum of the depths of the nodes of the subtree, its root being at the
+ * given depth.
+ */
+static double depth_sum_(const struct bstree_link *root, int depth)
+{
+    if (!root) {
+        return 0;
+    }
+    return depth + depth_sum_(root->left, depth + 1) +
+        depth_sum_(root->right, depth + 1);
+}
+
+void bstree_stats(const struct bstree *tree, struct bstree_stats *stats)
+{
+    const struct bstree_backend *backend = tree->ops->backend;
+    int size = backend ? backend->size(tree) : size_(tree->root);
+    stats->size = size;
+    stats->height = backend ? backend->height(tree) : height_(tree->root);
+    stats->min_height = -1;
+    while (size > 0) {
+        stats->min_height++;
+        size /= 2;
+    }
+    stats->average_depth = !backend && stats->size ?
+        depth_sum_(tree->root, 1) / stats->size : 0;
+#ifdef BSTREE_STATS
+    stats->counting = 1;
+    stats->compare_calls = bstree_counters_.compare_calls;
+    stats->single_rotations = bstree_counters_.single_rotations;
+    stats->double_rotations = bstree_counters_.double_rotations;
+    stats->nodes_allocated = bstree_counters_.nodes_allocated;
+    stats->nodes_freed = bstree_counters_.nodes_freed;
+#else
+    stats->counting = 0;
+    stats->compare_calls = 0;
+    stats->single_rotations = 0;
+    stats->double_rotations = 0;
+    stats->nodes_allocated = 0;
+    stats->nodes_freed = 0;
+#endif
+}
+
+void *bstree_iter_first(struct bstree_iter *iter, const struct bstree *tree)
+{
+    const struct bstree_link *root = tree->root;
+    iter->depth = 0;
+    for (; root; root = root->left) {
+        iter->path[iter->depth++] = root;
+    }
+    return bstree_iter_object(iter);
+}
+
+void *bstree_iter_last(struct bstree_iter *iter, const struct bstree *tree)
+{
+    const struct bstree_link *root = tree->root;
+    iter->depth = 0;
+    for (; root; root = root->right) {
+        iter->path[iter->depth++] = root;
+    }
+    return bstree_iter_object(iter);
+}
+
+void *bstree_iter_seek(struct bstree_iter *iter, const struct bstree *tree,
+        const void *key)
+{
+    const struct bstree_link *root = tree->root;
+    uint64_t prefix = prefix_(tree->ops, key);
+    int found = 0;
+    iter->depth = 0;
+    while (root) {
+        int cmp = compare_(tree->ops, key, prefix, root);
+        iter->path[iter->depth++] = root;
+        if (cmp <= 0) {
+            /* The smallest one not less than the key so far */
+            found = iter->depth;
+            if (cmp == 0) {
+                break;
+            }
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    /* The path to the one we have found is a prefix of the search path */
+    iter->depth = found;
+    return bstree_iter_object(iter);
+}
+
+void *bstree_iter_next(struct bstree_iter *iter)
+{
+    const struct bstree_link *node, *child;
+    if (iter->depth == 0) {
+        return NULL;
+    }
+    node = iter->path[iter->depth - 1];
+    if (node->right) {
+        for (node = node->right; node; node = node->left) {
+            iter->path[iter->depth++] = node;
+        }
+    } else {
+        /* Go up until we come from a left child */
+        do {
+            child = iter->path[--iter->depth];
+        } while (iter->depth > 0
+                && iter->path[iter->depth - 1]->right == child);
+    }
+    return bstree_iter_object(iter);
+}
+
+void *bstree_iter_prev(struct bstree_iter *iter)
+{
+    const struct bstree_link *node, *child;
+    if (iter->depth == 0) {
+        return NULL;
+    }
+    node = iter->path[iter->depth - 1];
+    if (node->left) {
+        for (node = node->left; node; node = node->right) {
+            iter->path[iter->depth++] = node;
+        }
+    } else {
+        /* Go up until we come from a right child */
+        do {
+            child = iter->path[--iter->depth];
+        } while (iter->depth > 0
+                && iter->path[iter->depth - 1]->left == child);
+    }
+    return bstree_iter_object(iter);
+}
+
+void *bstree_iter_object(const struct bstree_iter *iter)
+{
+    return iter->depth ? node_(iter->path[iter->depth - 1])->object : NULL;
+}
+
+int bstree_iter_count(const struct bstree_iter *iter)
+{
+    return iter->depth ? iter->path[iter->depth - 1]->count : 0;
+}
+
+/* Move the hint to the link holding the node matching the key, or to the
+ * empty link where it would be, and return that link. The path of the hint
+ * is first cut where it no longer follows the tree, as rotations may have
+ * moved its nodes since. Then, walking up from its end, a level is kept only
+ * if the key falls between the two closest nodes above it we went right and
+ * left from, each of which is compared at most once up to the first level
+ * that fits. The rest of the way down is a usual descent.
+ */
+static struct bstree_link **hint_find_(struct bstree *tree,
+        struct bstree_hint *hint, const void *key)
+{
+    const struct bstree_ops *ops = tree->ops;
+    struct bstree_link ***path = hint->path;
+    uint64_t prefix = prefix_(ops, key);
+    int i, level, lower = 0, upper = 0, depth;
+    struct bstree_link **link;
+    if (hint->depth == 0 || path[0] != &tree->root) {
+        path[0] = &tree->root;
+        hint->depth = 1;
+    }
+    for (i = 1; i < hint->depth; i++) {
+        if (!*path[i - 1] || (path[i] != &(*path[i - 1])->left &&
+                    path[i] != &(*path[i - 1])->right)) {
+            hint->depth = i;
+            break;
+        }
+    }
+    level = hint->depth - 1;
+    for (i = level - 1; i >= 0 && !(lower && upper); i--) {
+        int right = path[i + 1] == &(*path[i])->right;
+        int cmp;
+        if (right ? lower : upper) {
+            continue;
+        }
+        cmp = compare_(ops, key, prefix, *path[i]);
+        if (right ? cmp > 0 : cmp < 0) {
+            lower |= right;
+            upper |= !right;
+        } else {
+            level = i;
+            lower = upper = 0;
+        }
+    }
+    link = find_link_(path[level], ops, key, path + level, &depth);
+    hint->depth = level + depth + 1;
+    path[hint->depth - 1] = link;
+    return link;
+}
+
+void bstree_hint_init(struct bstree_hint *hint)
+{
+    hint->depth = 0;
+}
+
+void *bstree_hint_search(struct bstree *tree, struct bstree_hint *hint,
+        const void *key)
+{
+    struct bstree_link **link;
+    if (tree->ops->backend || !hint) {
+        return bstree_search(tree, key);
+    }
+    link = hint_find_(tree, hint, key);
+    return *link ? node_(*link)->object : NULL;
+}
+
+void bstree_hint_insert(struct bstree *tree, struct bstree_hint *hint,
+        void *object)
+{
+    struct bstree_link **link;
+    if (tree->ops->backend || !hint) {
+        bstree_insert(tree, object);
+        return;
+    }
+    link = hint_find_(tree, hint, object);
+    if (*link) {
+        /* Same as in insert_ */
+        (*link)->count++;
+        (*link)->size_cnt++;
+        update_path_(hint->path, hint->depth - 1);
+        if (tree->ops->free_object) {
+            tree->ops->free_object(object);
+        }
+        return;
+    }
+    *link = mknode_(tree->ops, object);
+    rebalance_path_(hint->path, hint->depth - 1);
+}
+
+void bstree_root_init(struct bstree_root *root,
+        int (*compare_link)(const struct bstree_link *lhs,
+            const struct bstree_link *rhs))
+{
+    root->link = NULL;
+    root->compare_link = compare_link;
+}
+
+struct bstree_link *bstree_link_insert(struct bstree_root *root,
+        struct bstree_link *link)
+{
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct bstree_link **pos = find_link_intrusive_(root, link, path, &depth);
+    if (*pos) {
+        (*pos)->count++;
+        (*pos)->size_cnt++;
+        update_path_(path, depth);
+        return *pos;
+    }
+    link->left = NULL;
+    link->right = NULL;
+    link->count = 1;
+    link->height = 0;
+    link->size = 1;
+    link->size_cnt = 1;
+    *pos = link;
+    rebalance_path_(path, depth);
+    return NULL;
+}
+
+struct bstree_link *bstree_link_search(const struct bstree_root *root,
+        const struct bstree_link *key)
+{
+    struct bstree_link *link = root->link;
+    while (link) {
+        int cmp = root->compare_link(key, link);
+        COUNT_(compare_calls);
+        if (cmp < 0) {
+            link = link->left;
+        } else if (cmp > 0) {
+            link = link->right;
+        } else {
+            break;
+        }
+    }
+    return link;
+}
+
+struct bstree_link *bstree_link_remove(struct bstree_root *root,
+        const struct bstree_link *key)
+{
+    struct bstree_link **path[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct bstree_link **pos = find_link_intrusive_(root, key, path, &depth);
+    struct bstree_link *link = *pos;
+    if (link) {
+        unlink_(path, depth, pos);
+    }
+    return link;
+}
+
+int bstree_link_traverse_inorder(const struct bstree_root *root,
+        void *it_data,
+        int (*operation)(struct bstree_link *link, void *it_data))
+{
+    return traverse_links_(root->link, it_data, operation);
+}
@@ -19,6 +19,14 @@
 #ifndef BSTREE_H
 #define BSTREE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* The height of an AVL tree of n nodes is below 1.44 * log2(n + 2), so as
+ * long as node counts fit in an int no path from the root is longer than this.
+ */
+#define BSTREE_MAX_HEIGHT 64
+
 /* Some notes:
  ** No duplicate keys will be present in the tree, inserting an already
  * existing value will increase the count held at the node. Functions that have
@@ -26,8 +34,23 @@
  * found node, with details explained for each of them below.
  */
 
+/* The part of a node the balancing code works on. A struct bstree allocates
+ * these for the objects it holds, intrusive trees (see the bottom of this
+ * file) expect them to be embedded in the objects themselves.
+ */
+struct bstree_link {
+    struct bstree_link *left;
+    struct bstree_link *right;
+    /* Sum of the counts in the subtree rooted here */
+    long size_cnt;
+    int count;
+    int height;
+    /* Number of nodes in the subtree rooted here */
+    int size;
+};
+
 struct bstree {
-    struct bstree_node *root;
+    struct bstree_link *root;
     struct bstree_ops *ops;
 };
 
@@ -35,6 +58,211 @@ struct bstree *bstree_new(
         int (*compare_object)(const void *lhs, const void *rhs),
         void (*free_object)(void *object));
 
+/* Like bstree_new, but the nodes of the tree are carved out of big chunks
+ * instead of being malloc'd one by one. Nodes of removed objects are kept
+ * for reuse by later insertions, and the memory is only given back when the
+ * tree is destroyed, in one go. Destroying a pooled tree does not need to walk
+ * the nodes at all if the objects are not owned by the tree (free_object is
+ * NULL).
+ */
+struct bstree *bstree_new_pooled(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but every node also keeps a 64 bit key prefix of its object,
+ * as given by key_object, and compares those directly while descending the
+ * tree. compare_object is only called for objects with equal prefixes, so a
+ * search usually makes a single call to it, the one finding the match. The
+ * prefixes must be ordered consistently with the objects, that is
+ * key_object(a) < key_object(b) must imply compare_object(a, b) < 0.
+ * Integer keys can be their own prefix, see bstree_str_prefix for strings.
+ */
+struct bstree *bstree_new_keyed(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object),
+        uint64_t (*key_object)(const void *object));
+
+/* Return the first 8 bytes of the string as a prefix for bstree_new_keyed,
+ * ordered the same way strcmp orders the strings.
+ */
+uint64_t bstree_str_prefix(const char *str);
+
+/* Like bstree_new, but the nodes are kept in one array and refer to each other
+ * by 32 bit indices, packed in half the space of the default nodes. Compact
+ * trees support insertion, replacement, removal, search, count, in order
+ * traversal, size and height, and bounds, rank, select and sampling
+ * queries in linear time. All the other functions need the default layout.
+ */
+struct bstree *bstree_new_compact(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but every node holds up to 15 objects in a sorted array,
+ * searched by bisection, so that the tree is about four times less tall and
+ * a search visits that many times fewer nodes, which is what costs the most
+ * in trees too large for the cache. The height is counted in nodes too. Like
+ * compact trees, B-trees only support the basic operations, and in addition
+ * range traversals.
+ */
+struct bstree *bstree_new_btree(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new, but the tree can be shared between threads. Searches,
+ * counts, traversals and size queries run in parallel with each other,
+ * insertion, replacement and removal wait for them and run one at a time.
+ * Like compact trees, these only support the basic operations. As nothing
+ * stops another thread from removing it, the object returned by a search
+ * can only be relied on if the objects are not owned by the tree, or are not
+ * removed while others use them. Traversals hold the tree, so the given
+ * operation must not modify it, though it may search it and query it.
+ */
+struct bstree *bstree_new_sync(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Like bstree_new_sync, but searches, counts, traversals and size queries
+ * never wait: they take no lock, and run on the version of the tree that was
+ * current when they started while an update makes the next one. Updates copy
+ * the nodes they change instead of modifying them, and free the replaced
+ * nodes and objects only once no reader can be looking at them anymore. An
+ * object returned by a search stays valid between bstree_rcu_read_lock and
+ * bstree_rcu_read_unlock, if the search is made between the two.
+ */
+struct bstree *bstree_new_rcu(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object));
+
+/* Start and end a read side critical section of a tree made with
+ * bstree_new_rcu, the value returned by the former being given to the
+ * latter. Sections may nest, but must not contain updates of the same tree,
+ * which would wait for them forever.
+ */
+int bstree_rcu_read_lock(const struct bstree *tree);
+void bstree_rcu_read_unlock(const struct bstree *tree, int token);
+
+/* Return a tree holding what the given one, made with bstree_new_rcu, holds
+ * right now, in constant time. The two share their nodes: later updates of
+ * the tree copy the nodes they change, leaving those of the snapshot alone.
+ * Snapshots cannot be updated, and support the same operations as the tree,
+ * except that they need no read side critical sections. The objects belong to
+ * the tree, and removed ones are not freed while a snapshot holds them.
+ * Destroy the snapshots before the tree. Returns NULL for other kinds of
+ * trees.
+ */
+struct bstree *bstree_snapshot(const struct bstree *tree);
+
+/* Write the objects of the tree, in order and with their counts, to the file
+ * at the given path. Each object is written as encode puts it in buf, which
+ * is ready for as many bytes as encode returns when buf is NULL. Returns 0 on
+ * success, -1 with errno set otherwise, to EOVERFLOW if an object takes 4 GiB
+ * or more, in which case the file is left alone.
+ */
+int bstree_save(const struct bstree *tree, const char *path,
+        size_t (*encode)(const void *object, void *buf));
+
+/* Map a file written by bstree_save into memory, read only, and return it as
+ * a tree, or NULL if it cannot be mapped or is not such a file. The entries
+ * are checked to lie within the file upfront, but the objects are not
+ * parsed: the objects of the tree are the encoded ones, right in the mapping
+ * (at addresses aligned to 8 bytes), which is what compare_object gets and
+ * bstree_search returns. Those of an untrusted file are only as well formed
+ * as the file, and compare_object must not read past their encoded length.
+ * The tree supports search, count, in order traversal, size and height, and
+ * updates do nothing. The file is unmapped by bstree_destroy.
+ */
+struct bstree *bstree_mmap_load(const char *path,
+        int (*compare_object)(const void *lhs, const void *rhs));
+
+/* Return a read only copy of the tree, laid out for fast searches, which is
+ * worth it for trees searched far more often than they are updated. It
+ * supports search, count, in order and range traversals, size and height,
+ * and updates do nothing. The copy shares the objects of the tree without
+ * owning them, so it must not be used after they are freed. Returns NULL
+ * if the memory for the copy runs out.
+ */
+struct bstree *bstree_freeze(const struct bstree *tree);
+
+/* Fill the given empty tree with the n objects in the array, which must be
+ * sorted in increasing order, without any two of them being equal. This takes
+ * linear time, instead of the n log n time inserting them one by one would.
+ * The nodes are allocated in one contiguous block, as a chunk of the pool of
+ * the tree, which makes it a pooled tree if it was not one already (see
+ * bstree_new_pooled). A tree that is not empty gets the objects merged in,
+ * with the counts of equal ones adding up, as bstree_union would, and trees
+ * not using the default node layout get them inserted one by one.
+ */
+void bstree_build_sorted(struct bstree *tree, void **objects, int n);
+
+/* Like build_sorted, but equal objects may follow each other in the array.
+ * They end up in the same node, with its count set accordingly, as if they
+ * were inserted one by one.
+ */
+void bstree_build_sorted_cnt(struct bstree *tree, void **objects, int n);
+
+/* Let bstree_build_sorted, bstree_build_sorted_cnt, bstree_union,
+ * bstree_intersect, bstree_difference and bstree_destroy of the tree
+ * (made with the default layout) use up to the given number of threads,
+ * working on subtrees of many thousands of nodes each. If the tree owns its
+ * objects, free_object has to be safe to call from several threads at once.
+ * Trees start out using one thread.
+ */
+void bstree_set_threads(struct bstree *tree, int threads);
+
+/* Put a cache of the given number of slots, rounded up to a power of two, in
+ * front of bstree_search and bstree_count of the tree (made with the default
+ * layout), or remove it if slots is 0. Each slot holds the node last found
+ * for the keys hashing to it, so when a few keys are looked up far more
+ * often than the others, they are mostly found by one hash and one
+ * comparison. hash_object must give equal hashes for objects comparing
+ * equal. Removal and replacement of a key clear its slot, and the operations
+ * moving many nodes at once clear them all. As searches update the cache,
+ * they must not run in parallel on a cached tree.
+ */
+void bstree_set_cache(struct bstree *tree, int slots,
+        uint64_t (*hash_object)(const void *object));
+
+/* Store in hits and misses the number of searches and counts that found
+ * their key in the cache of the tree, and of those that did not, since the
+ * cache was set.
+ */
+void bstree_cache_stats(const struct bstree *tree, long *hits, long *misses);
+
+/* The following functions move nodes between two trees, which have to order
+ * their objects the same way, and be made by the same constructor, except
+ * that pooled and non pooled trees can be mixed at the cost of copying the
+ * nodes. They do nothing for trees not using the default layout.
+ */
+
+/* Move all the objects of right, each of which must be greater than all the
+ * objects of tree, into tree. Takes O(log n) time, if no copying is needed.
+ */
+void bstree_join(struct bstree *tree, struct bstree *right);
+
+/* Move the objects of tree not less than the key into right, which must be
+ * empty, in O(log n) time. Right allocates its nodes from the pool of tree
+ * afterwards, if tree is pooled.
+ */
+void bstree_split(struct bstree *tree, const void *key, struct bstree *right);
+
+/* Move the objects of other into tree, the counts of equal objects adding
+ * up, as if they were inserted one by one. For trees of m and n (m <= n)
+ * nodes, it takes O(m log(n / m + 1)) time, which is linear at worst.
+ */
+void bstree_union(struct bstree *tree, struct bstree *other);
+
+/* Keep only the objects of tree also found in other, with the smaller of the
+ * two counts, in the same time as bstree_union. The objects of other are
+ * removed from it.
+ */
+void bstree_intersect(struct bstree *tree, struct bstree *other);
+
+/* Take the counts of the objects of other off those of the equal objects of
+ * tree, removing the objects whose count drops to zero, in the same time as
+ * bstree_union. The objects of other are removed from it.
+ */
+void bstree_difference(struct bstree *tree, struct bstree *other);
+
 /* Inserts the given object to the tree. If the object already exists,
  * increment the count.
  */
@@ -45,6 +273,18 @@ void bstree_insert(struct bstree *tree, void *object);
  */
 void bstree_replace(struct bstree *tree, void *object);
 
+/* Return the object matching the key, and if there is none, insert the one
+ * make_object returns for the key first and return that, in a single
+ * descent. The count of an object found is left alone, and make_object is
+ * only called when the key is not in the tree. The object it makes must
+ * compare equal to the key. Synchronized and RCU trees do both under the
+ * writer lock, so that the object returned is the one in the tree even with
+ * other threads inserting the same key. Read-only trees (frozen, loaded with
+ * bstree_mmap_load, or snapshots) return NULL without calling make_object.
+ */
+void *bstree_find_or_insert(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key));
+
 /* Destroy everything, ggwp.
  */
 void bstree_destroy(struct bstree *tree);
@@ -66,6 +306,49 @@ int bstree_traverse_inorder(const struct bstree *tree, void *it_data,
 int bstree_traverse_inorder_cnt(const struct bstree *tree, void *it_data,
         int (*operation)(void *object, void *it_data));
 
+/* Traverse only the objects not less than lo and less than hi, in order, in
+ * the same fashion as bstree_traverse_inorder. Either bound may be NULL, in
+ * which case the range is unbounded on that side. Subtrees outside the range
+ * are skipped, so this takes O(log n + k) time, k being the number of objects
+ * visited.
+ */
+int bstree_traverse_range(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data));
+
+/* Same as above, applying the operation 'count' times for each object.
+ */
+int bstree_traverse_range_cnt(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data));
+
+/* Visit every object once, like bstree_traverse_inorder does, on the given
+ * number of threads (the calling one included), taken as 1 if lower, as in
+ * bstree_set_threads. Thread i visits the i-th of as many consecutive parts
+ * of the tree, in order, with accs[i] as it_data, stopping early if the
+ * operation returns non zero. Then, unless combine is NULL, combine(accs[0],
+ * accs[i]) is called for every i > 0 in turn, on the calling thread, to
+ * merge the results into accs[0]. The parts are found by the subtree sizes,
+ * so they take O(log n) time to locate. Trees not using the default node
+ * layout, which keep no subtree sizes, are visited in a single part, as they
+ * are if the tasks cannot be allocated. The operation must not modify the
+ * tree.
+ */
+void bstree_parallel_for_each(const struct bstree *tree, int threads,
+        void **accs, int (*operation)(void *object, void *it_data),
+        void (*combine)(void *acc, void *other));
+
+/* Return the smallest object not less than the given key, or NULL if there
+ * is none. Trees not using the default node layout are walked in order from
+ * their start, or from the key for those supporting range traversals.
+ */
+void *bstree_lower_bound(const struct bstree *tree, const void *key);
+
+/* Return the smallest object greater than the given key, or NULL if there is
+ * none.
+ */
+void *bstree_upper_bound(const struct bstree *tree, const void *key);
+
 /* Return the count of the given key.
  */
 int bstree_count(const struct bstree *tree, const void *key);
@@ -74,6 +357,14 @@ int bstree_count(const struct bstree *tree, const void *key);
  */
 void *bstree_search(const struct bstree *tree, const void *key);
 
+/* Look up the n given keys, storing the object matching keys[i], or NULL, in
+ * out[i]. The lookups are interleaved, prefetching the next node of each,
+ * which saves waiting on cache misses one lookup at a time for trees larger
+ * than the cache.
+ */
+void bstree_search_batch(const struct bstree *tree, const void *const *keys,
+        int n, void **out);
+
 /* Finds and removes the node matching the given key.
  * If the user wants the node removed but does not want the object to be free'd,
  * he/she shall supply ops with ops->free_object set to NULL.
@@ -81,13 +372,235 @@ void *bstree_search(const struct bstree *tree, const void *key);
  */
 void bstree_remove(struct bstree *tree, const void *key);
 
-/* Return the number of nodes in the tree.
+/* Remove the nodes matching any of the n keys, which must be sorted, as
+ * bstree_remove would one by one, keys not in the tree being skipped. The
+ * nodes are taken out of the subtrees they are in, and only the parts left
+ * are rebalanced when joined back together, which takes O(n log(m / n + 1))
+ * time for a tree of m nodes, linear at worst, instead of paying the
+ * rebalancing of a full removal per key.
+ */
+void bstree_remove_batch(struct bstree *tree, const void *const *keys, int n);
+
+/* Return the number of nodes in the tree, in constant time.
  */
 int bstree_size(struct bstree *tree);
 
+/* Return the sum of the counts of all the nodes in the tree, that is the
+ * number of objects inserted and not yet removed, in constant time.
+ */
+long bstree_size_cnt(struct bstree *tree);
+
+/* Return the object at the given (zero based) position in the sorted order of
+ * the tree, or NULL if k is out of range. Takes logarithmic time, but linear
+ * time for trees not using the default node layout, which keep no subtree
+ * sizes and get walked in order instead.
+ */
+void *bstree_select(const struct bstree *tree, int k);
+
+/* Like select, but with every object occupying 'count' positions, so that
+ * k ranges from 0 to bstree_size_cnt - 1.
+ */
+void *bstree_select_cnt(const struct bstree *tree, long k);
+
+/* Return the number of nodes holding keys smaller than the given one, which
+ * need not be in the tree. Takes logarithmic time, or linear time like
+ * bstree_select for trees not using the default node layout.
+ */
+int bstree_rank(const struct bstree *tree, const void *key);
+
+/* Like rank, but with every node counting 'count' times.
+ */
+long bstree_rank_cnt(const struct bstree *tree, const void *key);
+
+/* Return an object with probability proportional to its count, r being a
+ * uniformly distributed random number in [0, 1). This is the object at
+ * position r * bstree_size_cnt in the order bstree_select_cnt uses, found in
+ * the time that takes. Returns NULL if the tree is empty.
+ */
+void *bstree_sample_weighted(const struct bstree *tree, double r);
+
 /* Return the length of the longest path from the root to a leaf.
  * Empty tree has height -1, a tree consisting of a single node has height 0.
  */
 int bstree_height(struct bstree *tree);
 
+/* The shape of a tree, and what the library did since the program started.
+ * The counters are shared by all the trees, and only kept if the library is
+ * built with BSTREE_STATS defined (as in make CFLAGS+=-DBSTREE_STATS), being
+ * 0 otherwise.
+ */
+struct bstree_stats {
+    int size;
+    int height;
+    /* The height of a perfectly balanced tree of the same size */
+    int min_height;
+    /* The number of nodes a search for an object of the tree visits, on
+     * average over the objects. Only known for the default layout, 0 for
+     * the others.
+     */
+    double average_depth;
+    /* Whether the library keeps the counters below, that is whether it was
+     * built with BSTREE_STATS defined
+     */
+    int counting;
+    /* Calls to the comparison function from the library, by trees of any
+     * kind, leaving out those avoided by the prefixes of keyed trees
+     */
+    long compare_calls;
+    /* Rebalancing steps of AVL trees of any layout, a double rotation
+     * counting once
+     */
+    long single_rotations;
+    long double_rotations;
+    /* Nodes of trees with the default layout */
+    long nodes_allocated;
+    long nodes_freed;
+};
+
+/* Fill stats for the tree. Takes linear time for the average depth.
+ */
+void bstree_stats(const struct bstree *tree, struct bstree_stats *stats);
+
+/* Iterators:
+ ** An iterator points to a node of the tree, or past the end of it. It holds
+ * the path from the root to that node, so stepping to the next or previous
+ * node takes amortized constant time and no recursion. Iterators can be freely
+ * copied, and need no cleanup, but any modification of the tree invalidates
+ * all of its iterators. They walk the nodes of the default layout: on trees
+ * using another one, such as compact, mapped or frozen trees, iterators
+ * start past the end, as for an empty tree.
+ */
+
+struct bstree_iter {
+    const struct bstree_link *path[BSTREE_MAX_HEIGHT];
+    int depth;
+};
+
+/* Point the iterator to the smallest object of the tree and return it.
+ * Returns NULL and points past the end if the tree is empty.
+ */
+void *bstree_iter_first(struct bstree_iter *iter, const struct bstree *tree);
+
+/* Point the iterator to the largest object of the tree and return it.
+ */
+void *bstree_iter_last(struct bstree_iter *iter, const struct bstree *tree);
+
+/* Point the iterator to the smallest object not less than the given key and
+ * return it, or NULL if there is no such object.
+ */
+void *bstree_iter_seek(struct bstree_iter *iter, const struct bstree *tree,
+        const void *key);
+
+/* Step to the next (or previous) object in order and return it. Stepping
+ * past either end of the tree returns NULL, and leaves the iterator past the
+ * end, where stepping further keeps returning NULL.
+ */
+void *bstree_iter_next(struct bstree_iter *iter);
+void *bstree_iter_prev(struct bstree_iter *iter);
+
+/* Return the object the iterator points to, NULL if it is past the end.
+ */
+void *bstree_iter_object(const struct bstree_iter *iter);
+
+/* Return the count of the object the iterator points to, 0 if it is past the
+ * end.
+ */
+int bstree_iter_count(const struct bstree_iter *iter);
+
+/* Hints:
+ ** A hint remembers where the last operation made through it ended up in the
+ * tree (made with the default layout), and the next one starts from there,
+ * going up only as far as needed to reach a subtree the key belongs to.
+ * Looking a key up and then inserting it through the same hint descends
+ * once, and inserting keys that are close to each other, like increasing
+ * ones, costs a few comparisons each instead of a full descent. A hint stays
+ * usable whatever happens to the tree, as long as the tree exists: the part
+ * of its path the tree no longer follows is dropped on its next use, and a
+ * hint of another tree starts from the root. The functions below take a NULL
+ * hint as one starting from the root every time.
+ */
+
+struct bstree_hint {
+    struct bstree_link **path[BSTREE_MAX_HEIGHT + 1];
+    int depth;
+};
+
+/* Reset the hint, making the next operation start from the root.
+ */
+void bstree_hint_init(struct bstree_hint *hint);
+
+/* Same as bstree_search, starting from the hint, and leaving it at the
+ * object found or where it would be inserted.
+ */
+void *bstree_hint_search(struct bstree *tree, struct bstree_hint *hint,
+        const void *key);
+
+/* Same as bstree_insert, starting from the hint, and leaving it at the
+ * inserted object.
+ */
+void bstree_hint_insert(struct bstree *tree, struct bstree_hint *hint,
+        void *object);
+
+/* Intrusive trees:
+ ** Instead of us allocating a node for every object, the objects embed a
+ * struct bstree_link, and the tree is made out of those. The comparison
+ * function gets the links, and bstree_entry gives back the enclosing object:
+ *
+ *     struct word {
+ *         char *str;
+ *         struct bstree_link link;
+ *     };
+ *
+ *     int cmp_word(const struct bstree_link *lhs,
+ *             const struct bstree_link *rhs)
+ *     {
+ *         return strcmp(bstree_entry(lhs, struct word, link)->str,
+ *                 bstree_entry(rhs, struct word, link)->str);
+ *     }
+ *
+ * Keys to search for are links as well, embedded in an object holding the
+ * key, just like the keys given to bstree_search. The tree never allocates
+ * or frees anything, the lifetime of the objects is up to the user.
+ */
+
+#define bstree_entry(link, type, member) \
+    ((type *)((char *)(link) - offsetof(type, member)))
+
+struct bstree_root {
+    struct bstree_link *link;
+    int (*compare_link)(const struct bstree_link *lhs,
+            const struct bstree_link *rhs);
+};
+
+/* Make the given root an empty tree ordered by compare_link.
+ */
+void bstree_root_init(struct bstree_root *root,
+        int (*compare_link)(const struct bstree_link *lhs,
+            const struct bstree_link *rhs));
+
+/* Link the given object into the tree and return NULL. If an equal object is
+ * already in the tree, the given link is left alone, the count of the existing
+ * one is incremented and the existing one is returned.
+ */
+struct bstree_link *bstree_link_insert(struct bstree_root *root,
+        struct bstree_link *link);
+
+/* Return the link matching the given key, or NULL if there is none.
+ */
+struct bstree_link *bstree_link_search(const struct bstree_root *root,
+        const struct bstree_link *key);
+
+/* Unlink the link matching the given key, regardless of its count, and return
+ * it so that the user can dispose of its object. Returns NULL if there is no
+ * matching link.
+ */
+struct bstree_link *bstree_link_remove(struct bstree_root *root,
+        const struct bstree_link *key);
+
+/* Like bstree_traverse_inorder, with the operation getting the links.
+ */
+int bstree_link_traverse_inorder(const struct bstree_root *root,
+        void *it_data,
+        int (*operation)(struct bstree_link *link, void *it_data));
+
 #endif
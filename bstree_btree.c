@@ -0,0 +1,514 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* B-tree backend: every node holds up to MAX_KEYS objects in a sorted array,
+ * and one more child than objects. With one object per node, a search visits
+ * a new node, and most likely misses the cache, at every one of its ~log2(n)
+ * steps. Here it visits one node every ~log2(MAX_KEYS) steps, done by a
+ * binary search over the array, and the tree is that many times less tall.
+ * Nodes are split on the way down when full, and are given an object from a
+ * neighbour or merged with one on the way down when at the minimum, so that
+ * updates need a single pass from the root, like in bstree.c.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_KEYS 7
+
+#define MAX_KEYS (2 * MIN_KEYS + 1)
+
+struct bnode {
+    int n;
+    int leaf;
+    void *objects[MAX_KEYS];
+    uint32_t counts[MAX_KEYS];
+    /* Unused in leaves */
+    struct bnode *children[MAX_KEYS + 1];
+};
+
+struct btree {
+    struct bnode *root;
+    int size;
+    long size_cnt;
+};
+
+static struct btree *btree_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+static struct bnode *mknode_(int leaf)
+{
+    struct bnode *node = malloc(sizeof *node);
+    node->n = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+/* Every comparison goes through here, to be counted for bstree_stats */
+static int compare_(const struct bstree_ops *ops, const void *key,
+        const void *object)
+{
+    COUNT_(compare_calls);
+    return ops->compare_object(key, object);
+}
+
+/* Return the index of the first object of the node not less than the key,
+ * node->n if there is none. The comparison only decides how far the bounds
+ * move, not where the code goes, so that there is no branch to mispredict
+ * but the loop, which runs the same for nodes of the same size.
+ */
+static int position_(const struct bstree_ops *ops, const struct bnode *node,
+        const void *key)
+{
+    int base = 0, n = node->n;
+    while (n > 0) {
+        int half = n / 2;
+        int greater = compare_(ops, key, node->objects[base + half]) > 0;
+        base += greater * (half + 1);
+        n = greater ? n - half - 1 : half;
+    }
+    return base;
+}
+
+/* Find the key, returning the node holding it with its index in *pos, or NULL.
+ * The objects of a node are all loaded up front, as they go to the cache at
+ * the same time this way instead of one after the other. We go all the way
+ * down without checking for equality, remembering the last object not less
+ * than the key, which is then the least such object in the tree.
+ */
+static struct bnode *find_(const struct bstree *tree, const void *key,
+        int *pos)
+{
+    struct bnode *node = btree_(tree)->root, *found = NULL;
+    int i;
+    while (node) {
+        for (i = 0; i < node->n; i++) {
+            __builtin_prefetch(node->objects[i]);
+        }
+        i = position_(tree->ops, node, key);
+        if (i < node->n) {
+            found = node;
+            *pos = i;
+        }
+        node = node->leaf ? NULL : node->children[i];
+    }
+    if (found && compare_(tree->ops, key, found->objects[*pos]) == 0) {
+        return found;
+    }
+    return NULL;
+}
+
+/* Open a gap at index i of the node, and at i + 1 of its children, or close
+ * it, shifting everything after it.
+ */
+static void open_(struct bnode *node, int i)
+{
+    memmove(node->objects + i + 1, node->objects + i,
+            (node->n - i) * sizeof *node->objects);
+    memmove(node->counts + i + 1, node->counts + i,
+            (node->n - i) * sizeof *node->counts);
+    if (!node->leaf) {
+        memmove(node->children + i + 2, node->children + i + 1,
+                (node->n - i) * sizeof *node->children);
+    }
+    node->n++;
+}
+
+static void close_(struct bnode *node, int i)
+{
+    node->n--;
+    memmove(node->objects + i, node->objects + i + 1,
+            (node->n - i) * sizeof *node->objects);
+    memmove(node->counts + i, node->counts + i + 1,
+            (node->n - i) * sizeof *node->counts);
+    if (!node->leaf) {
+        memmove(node->children + i + 1, node->children + i + 2,
+                (node->n - i) * sizeof *node->children);
+    }
+}
+
+/* Split the full i-th child of the node in two, its middle object going up
+ * to the node at index i.
+ */
+static void split_child_(struct bnode *node, int i)
+{
+    struct bnode *left = node->children[i];
+    struct bnode *right = mknode_(left->leaf);
+    right->n = MIN_KEYS;
+    memcpy(right->objects, left->objects + MIN_KEYS + 1,
+            MIN_KEYS * sizeof *right->objects);
+    memcpy(right->counts, left->counts + MIN_KEYS + 1,
+            MIN_KEYS * sizeof *right->counts);
+    if (!left->leaf) {
+        memcpy(right->children, left->children + MIN_KEYS + 1,
+                (MIN_KEYS + 1) * sizeof *right->children);
+    }
+    left->n = MIN_KEYS;
+    open_(node, i);
+    node->objects[i] = left->objects[MIN_KEYS];
+    node->counts[i] = left->counts[MIN_KEYS];
+    node->children[i + 1] = right;
+}
+
+/* Merge the i + 1-th child of the node into the i-th one, with the object at
+ * index i between them, and return the merged child. A root left empty gives
+ * its place to the child.
+ */
+static struct bnode *merge_(struct btree *b, struct bnode *node, int i)
+{
+    struct bnode *left = node->children[i];
+    struct bnode *right = node->children[i + 1];
+    left->objects[left->n] = node->objects[i];
+    left->counts[left->n] = node->counts[i];
+    memcpy(left->objects + left->n + 1, right->objects,
+            right->n * sizeof *right->objects);
+    memcpy(left->counts + left->n + 1, right->counts,
+            right->n * sizeof *right->counts);
+    if (!left->leaf) {
+        memcpy(left->children + left->n + 1, right->children,
+                (right->n + 1) * sizeof *right->children);
+    }
+    left->n += right->n + 1;
+    free(right);
+    close_(node, i);
+    if (node == b->root && node->n == 0) {
+        b->root = left;
+        free(node);
+    }
+    return left;
+}
+
+/* Return the i-th child of the node, which we are about to go down to for a
+ * removal, after making sure it has an object to spare: by moving one there
+ * from a neighbour through the node, or merging it with a neighbour.
+ */
+static struct bnode *grow_child_(struct btree *b, struct bnode *node, int i)
+{
+    struct bnode *child = node->children[i], *sibling;
+    if (child->n > MIN_KEYS) {
+        return child;
+    }
+    if (i > 0 && (sibling = node->children[i - 1])->n > MIN_KEYS) {
+        open_(child, 0);
+        if (!child->leaf) {
+            child->children[1] = child->children[0];
+            child->children[0] = sibling->children[sibling->n];
+        }
+        child->objects[0] = node->objects[i - 1];
+        child->counts[0] = node->counts[i - 1];
+        node->objects[i - 1] = sibling->objects[sibling->n - 1];
+        node->counts[i - 1] = sibling->counts[sibling->n - 1];
+        sibling->n--;
+        return child;
+    }
+    if (i < node->n && (sibling = node->children[i + 1])->n > MIN_KEYS) {
+        child->objects[child->n] = node->objects[i];
+        child->counts[child->n] = node->counts[i];
+        if (!child->leaf) {
+            child->children[child->n + 1] = sibling->children[0];
+        }
+        child->n++;
+        node->objects[i] = sibling->objects[0];
+        node->counts[i] = sibling->counts[0];
+        if (!sibling->leaf) {
+            sibling->children[0] = sibling->children[1];
+        }
+        close_(sibling, 0);
+        return child;
+    }
+    return merge_(b, node, i < node->n ? i : i - 1);
+}
+
+/* Insert the object, or if make_object is given, the one it makes for the
+ * key when there is no equal object yet, and return the object left in the
+ * tree for the key.
+ */
+static void *insert_(struct bstree *tree, const void *key, void *object,
+        void *(*make_object)(const void *key), int replace)
+{
+    struct btree *b = btree_(tree);
+    struct bnode *node = b->root;
+    int i, cmp;
+    if (!node) {
+        node = b->root = mknode_(1);
+    } else if (node->n == MAX_KEYS) {
+        b->root = mknode_(0);
+        b->root->children[0] = node;
+        split_child_(b->root, 0);
+        node = b->root;
+    }
+    for (;;) {
+        i = position_(tree->ops, node, key);
+        cmp = i < node->n ? compare_(tree->ops, key, node->objects[i]) : -1;
+        if (cmp == 0) {
+            break;
+        }
+        if (node->leaf) {
+            if (make_object) {
+                object = make_object(key);
+            }
+            open_(node, i);
+            node->objects[i] = object;
+            node->counts[i] = 1;
+            b->size++;
+            b->size_cnt++;
+            return object;
+        }
+        if (node->children[i]->n == MAX_KEYS) {
+            split_child_(node, i);
+            cmp = compare_(tree->ops, key, node->objects[i]);
+            if (cmp == 0) {
+                break;
+            }
+            i += cmp > 0;
+        }
+        node = node->children[i];
+    }
+    if (make_object) {
+        return node->objects[i];
+    }
+    /* Equal key, same as in insert_ and replace_ of bstree.c */
+    if (replace) {
+        if (tree->ops->free_object) {
+            tree->ops->free_object(node->objects[i]);
+        }
+        node->objects[i] = object;
+        return object;
+    }
+    node->counts[i]++;
+    b->size_cnt++;
+    if (tree->ops->free_object) {
+        tree->ops->free_object(object);
+    }
+    return node->objects[i];
+}
+
+static void btree_insert_(struct bstree *tree, void *object)
+{
+    insert_(tree, object, object, NULL, 0);
+}
+
+static void btree_replace_(struct bstree *tree, void *object)
+{
+    insert_(tree, object, object, NULL, 1);
+}
+
+static void *btree_find_or_insert_(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key))
+{
+    return insert_(tree, key, NULL, make_object, 0);
+}
+
+/* Take the last object (first if !last) out of the subtree, which has one to
+ * spare, with its count.
+ */
+static void take_(struct btree *b, struct bnode *node, int last,
+        void **object, uint32_t *count)
+{
+    while (!node->leaf) {
+        node = grow_child_(b, node, last ? node->n : 0);
+    }
+    *object = node->objects[last ? node->n - 1 : 0];
+    *count = node->counts[last ? node->n - 1 : 0];
+    close_(node, last ? node->n - 1 : 0);
+}
+
+static void btree_remove_(struct bstree *tree, const void *key)
+{
+    struct btree *b = btree_(tree);
+    struct bnode *node = b->root;
+    int i;
+    while (node) {
+        i = position_(tree->ops, node, key);
+        if (i < node->n &&
+                compare_(tree->ops, key, node->objects[i]) == 0) {
+            break;
+        }
+        node = node->leaf ? NULL : grow_child_(b, node, i);
+    }
+    if (!node) {
+        return;
+    }
+    if (tree->ops->free_object) {
+        tree->ops->free_object(node->objects[i]);
+    }
+    b->size--;
+    b->size_cnt -= node->counts[i];
+    /* Put the neighbour from a child that can spare it in place of the
+     * object, or merge the children around it and remove it from there.
+     */
+    while (!node->leaf) {
+        if (node->children[i]->n > MIN_KEYS) {
+            take_(b, node->children[i], 1, &node->objects[i],
+                    &node->counts[i]);
+            return;
+        }
+        if (node->children[i + 1]->n > MIN_KEYS) {
+            take_(b, node->children[i + 1], 0, &node->objects[i],
+                    &node->counts[i]);
+            return;
+        }
+        node = merge_(b, node, i);
+        i = MIN_KEYS;
+    }
+    close_(node, i);
+    if (node == b->root && node->n == 0) {
+        free(node);
+        b->root = NULL;
+    }
+}
+
+static void *btree_search_(const struct bstree *tree, const void *key)
+{
+    int i;
+    struct bnode *node = find_(tree, key, &i);
+    return node ? node->objects[i] : NULL;
+}
+
+static int btree_count_(const struct bstree *tree, const void *key)
+{
+    int i;
+    struct bnode *node = find_(tree, key, &i);
+    return node ? (int)node->counts[i] : 0;
+}
+
+/* Traverse the objects of the subtree in [lo, hi), either bound being
+ * ignored when NULL.
+ */
+static int traverse_(const struct bstree_ops *ops, const struct bnode *node,
+        const void *lo, const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    int i;
+    uint32_t j;
+    if (!node) {
+        return 0;
+    }
+    for (i = lo ? position_(ops, node, lo) : 0; ; i++) {
+        if (!node->leaf && traverse_(ops, node->children[i], lo, hi,
+                    it_data, operation, cnt)) {
+            return 1;
+        }
+        /* Only the first child visited can hold objects below lo */
+        lo = NULL;
+        if (i == node->n ||
+                (hi && compare_(ops, hi, node->objects[i]) <= 0)) {
+            return 0;
+        }
+        for (j = 0; j < (cnt ? node->counts[i] : 1); j++) {
+            if (operation(node->objects[i], it_data)) {
+                return 1;
+            }
+        }
+    }
+}
+
+static int btree_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    return traverse_(tree->ops, btree_(tree)->root, NULL, NULL, it_data,
+            operation, cnt);
+}
+
+static int btree_traverse_range_(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    return traverse_(tree->ops, btree_(tree)->root, lo, hi, it_data,
+            operation, cnt);
+}
+
+static int btree_size_(const struct bstree *tree)
+{
+    return btree_(tree)->size;
+}
+
+static long btree_size_cnt_(const struct bstree *tree)
+{
+    return btree_(tree)->size_cnt;
+}
+
+/* All the leaves are at the same depth */
+static int btree_height_(const struct bstree *tree)
+{
+    const struct bnode *node = btree_(tree)->root;
+    int height = -1;
+    while (node) {
+        height++;
+        node = node->leaf ? NULL : node->children[0];
+    }
+    return height;
+}
+
+static void destroy_(const struct bstree_ops *ops, struct bnode *node)
+{
+    int i;
+    for (i = 0; i <= node->n; i++) {
+        if (!node->leaf) {
+            destroy_(ops, node->children[i]);
+        }
+        if (i < node->n && ops->free_object) {
+            ops->free_object(node->objects[i]);
+        }
+    }
+    free(node);
+}
+
+static void btree_destroy_(struct bstree *tree)
+{
+    struct btree *b = btree_(tree);
+    if (b->root) {
+        destroy_(tree->ops, b->root);
+    }
+    free(b);
+}
+
+static const struct bstree_backend btree_backend = {
+    btree_insert_,
+    btree_replace_,
+    btree_remove_,
+    btree_search_,
+    btree_count_,
+    btree_traverse_,
+    btree_size_,
+    btree_size_cnt_,
+    btree_height_,
+    btree_destroy_,
+    btree_traverse_range_,
+    btree_find_or_insert_
+};
+
+struct bstree *bstree_new_btree(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, free_object);
+    struct btree *b = malloc(sizeof *b);
+    b->root = NULL;
+    b->size = 0;
+    b->size_cnt = 0;
+    tree->ops->backend = &btree_backend;
+    tree->ops->impl = b;
+    return tree;
+}
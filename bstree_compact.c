@@ -0,0 +1,447 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compact backend: the nodes of the tree live in one array, and link to each
+ * other by 32 bit indices instead of pointers. The array can be moved around
+ * freely (and is, when it grows), and a node takes 24 bytes instead of the 48
+ * of the default layout. There are no subtree sizes kept in the nodes, so
+ * this backend only supports the basic operations.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+
+#define MAX_IMBALANCE 1
+
+#define MIN_CAPACITY 64
+
+/* Index 0 is never given to a node, it stands for the empty subtree. Every
+ * height is stored plus one, so that the height held at index 0 is the height
+ * of the empty tree, and looking it up needs no special casing.
+ */
+#define NIL 0
+
+struct cnode {
+    void *object;
+    uint32_t left;
+    uint32_t right;
+    uint32_t count;
+    uint8_t height;
+};
+
+struct compact {
+    struct cnode *nodes;
+    uint32_t capacity;
+    /* Indices below this have been given to a node at least once */
+    uint32_t used;
+    /* Removed nodes, linked through their left indices */
+    uint32_t free_nodes;
+    uint32_t root;
+    int size;
+    long size_cnt;
+};
+
+static struct compact *compact_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+static void update_(struct cnode *nodes, uint32_t root)
+{
+    nodes[root].height = MAX(nodes[nodes[root].left].height,
+            nodes[nodes[root].right].height) + 1;
+}
+
+static int imbalance_(const struct cnode *nodes, uint32_t root)
+{
+    return nodes[nodes[root].left].height - nodes[nodes[root].right].height;
+}
+
+static uint32_t rotate_with_left_(struct cnode *nodes, uint32_t root)
+{
+    uint32_t newroot = nodes[root].left;
+    nodes[root].left = nodes[newroot].right;
+    nodes[newroot].right = root;
+    update_(nodes, root);
+    update_(nodes, newroot);
+    return newroot;
+}
+
+static uint32_t rotate_with_right_(struct cnode *nodes, uint32_t root)
+{
+    uint32_t newroot = nodes[root].right;
+    nodes[root].right = nodes[newroot].left;
+    nodes[newroot].left = root;
+    update_(nodes, root);
+    update_(nodes, newroot);
+    return newroot;
+}
+
+/* Same as balance_ in bstree.c, see there.
+ */
+static uint32_t balance_(struct cnode *nodes, uint32_t root)
+{
+    if (imbalance_(nodes, root) > MAX_IMBALANCE) {
+        if (imbalance_(nodes, nodes[root].left) < 0) {
+            COUNT_(double_rotations);
+            nodes[root].left = rotate_with_right_(nodes, nodes[root].left);
+        } else {
+            COUNT_(single_rotations);
+        }
+        return rotate_with_left_(nodes, root);
+    }
+    if (imbalance_(nodes, root) < -MAX_IMBALANCE) {
+        if (imbalance_(nodes, nodes[root].right) > 0) {
+            COUNT_(double_rotations);
+            nodes[root].right = rotate_with_left_(nodes, nodes[root].right);
+        } else {
+            COUNT_(single_rotations);
+        }
+        return rotate_with_right_(nodes, root);
+    }
+    update_(nodes, root);
+    return root;
+}
+
+/* With indices we cannot keep the addresses of the links on the path, as the
+ * array may move while we are working on it. Instead, the path holds the
+ * nodes themselves, and dirs tells which child of each we went on with, 0 for
+ * the left one and 1 for the right one.
+ */
+static void set_child_(struct compact *c, const uint32_t path[],
+        const int dirs[], int depth, uint32_t child)
+{
+    if (depth == 0) {
+        c->root = child;
+    } else if (dirs[depth - 1]) {
+        c->nodes[path[depth - 1]].right = child;
+    } else {
+        c->nodes[path[depth - 1]].left = child;
+    }
+}
+
+static void rebalance_path_(struct compact *c, const uint32_t path[],
+        const int dirs[], int depth)
+{
+    while (depth-- > 0) {
+        uint8_t height = c->nodes[path[depth]].height;
+        uint32_t root = balance_(c->nodes, path[depth]);
+        set_child_(c, path, dirs, depth, root);
+        if (c->nodes[root].height == height) {
+            return;
+        }
+    }
+}
+
+/* Returns the node matching the key, or NIL, with the path leading to it
+ * (or to where it would be) recorded in path and dirs.
+ */
+static uint32_t find_path_(const struct bstree *tree, const void *key,
+        uint32_t path[], int dirs[], int *depth)
+{
+    const struct compact *c = compact_(tree);
+    uint32_t root = c->root;
+    *depth = 0;
+    while (root != NIL) {
+        int cmp;
+        COUNT_(compare_calls);
+        cmp = tree->ops->compare_object(key, c->nodes[root].object);
+        if (cmp == 0) {
+            break;
+        }
+        path[*depth] = root;
+        dirs[(*depth)++] = cmp > 0;
+        root = cmp > 0 ? c->nodes[root].right : c->nodes[root].left;
+    }
+    return root;
+}
+
+static uint32_t find_(const struct bstree *tree, const void *key)
+{
+    const struct compact *c = compact_(tree);
+    uint32_t root = c->root;
+    while (root != NIL) {
+        int cmp;
+        COUNT_(compare_calls);
+        cmp = tree->ops->compare_object(key, c->nodes[root].object);
+        if (cmp < 0) {
+            root = c->nodes[root].left;
+        } else if (cmp > 0) {
+            root = c->nodes[root].right;
+        } else {
+            break;
+        }
+    }
+    return root;
+}
+
+/* Returns NIL, leaving the tree as it was, if the array of nodes cannot be
+ * grown.
+ */
+static uint32_t mknode_(struct compact *c, void *object)
+{
+    uint32_t node;
+    if (c->free_nodes != NIL) {
+        node = c->free_nodes;
+        c->free_nodes = c->nodes[node].left;
+    } else {
+        if (c->used == c->capacity) {
+            struct cnode *nodes = realloc(c->nodes,
+                    2 * (size_t)c->capacity * sizeof *c->nodes);
+            if (!nodes) {
+                return NIL;
+            }
+            c->nodes = nodes;
+            c->capacity *= 2;
+        }
+        node = c->used++;
+    }
+    c->nodes[node].object = object;
+    c->nodes[node].left = NIL;
+    c->nodes[node].right = NIL;
+    c->nodes[node].count = 1;
+    c->nodes[node].height = 1;
+    return node;
+}
+
+static void insert_(struct bstree *tree, void *object, int replace)
+{
+    struct compact *c = compact_(tree);
+    uint32_t path[BSTREE_MAX_HEIGHT];
+    int dirs[BSTREE_MAX_HEIGHT];
+    int depth;
+    uint32_t node = find_path_(tree, object, path, dirs, &depth);
+    if (node != NIL) {
+        /* Equal key, same as in insert_ and replace_ of bstree.c */
+        if (replace) {
+            if (tree->ops->free_object) {
+                tree->ops->free_object(c->nodes[node].object);
+            }
+            c->nodes[node].object = object;
+            return;
+        }
+        c->nodes[node].count++;
+        c->size_cnt++;
+        if (tree->ops->free_object) {
+            tree->ops->free_object(object);
+        }
+        return;
+    }
+    node = mknode_(c, object);
+    if (node == NIL) {
+        /* Out of memory, the object is dropped like an equal one */
+        if (tree->ops->free_object) {
+            tree->ops->free_object(object);
+        }
+        return;
+    }
+    set_child_(c, path, dirs, depth, node);
+    c->size++;
+    c->size_cnt++;
+    rebalance_path_(c, path, dirs, depth);
+}
+
+static void compact_insert_(struct bstree *tree, void *object)
+{
+    insert_(tree, object, 0);
+}
+
+static void compact_replace_(struct bstree *tree, void *object)
+{
+    insert_(tree, object, 1);
+}
+
+static void *compact_find_or_insert_(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key))
+{
+    struct compact *c = compact_(tree);
+    uint32_t path[BSTREE_MAX_HEIGHT];
+    int dirs[BSTREE_MAX_HEIGHT];
+    int depth;
+    uint32_t node = find_path_(tree, key, path, dirs, &depth);
+    void *object;
+    if (node != NIL) {
+        return c->nodes[node].object;
+    }
+    /* The node is made first, so that running out of memory makes nothing */
+    node = mknode_(c, NULL);
+    if (node == NIL) {
+        return NULL;
+    }
+    object = make_object(key);
+    c->nodes[node].object = object;
+    set_child_(c, path, dirs, depth, node);
+    c->size++;
+    c->size_cnt++;
+    rebalance_path_(c, path, dirs, depth);
+    return object;
+}
+
+static void compact_remove_(struct bstree *tree, const void *key)
+{
+    struct compact *c = compact_(tree);
+    uint32_t path[BSTREE_MAX_HEIGHT];
+    int dirs[BSTREE_MAX_HEIGHT];
+    int depth;
+    uint32_t node = find_path_(tree, key, path, dirs, &depth);
+    struct cnode *nodes = c->nodes;
+    if (node == NIL) {
+        return;
+    }
+    if (tree->ops->free_object) {
+        tree->ops->free_object(nodes[node].object);
+    }
+    c->size--;
+    c->size_cnt -= nodes[node].count;
+    if (nodes[node].left == NIL || nodes[node].right == NIL) {
+        set_child_(c, path, dirs, depth, nodes[node].left != NIL ?
+                nodes[node].left : nodes[node].right);
+    } else {
+        /* Put the minimum of the right subtree in place of the node */
+        int top = depth;
+        uint32_t min = nodes[node].right;
+        path[depth] = node;
+        dirs[depth++] = 1;
+        while (nodes[min].left != NIL) {
+            path[depth] = min;
+            dirs[depth++] = 0;
+            min = nodes[min].left;
+        }
+        set_child_(c, path, dirs, depth, nodes[min].right);
+        nodes[min].left = nodes[node].left;
+        nodes[min].right = nodes[node].right;
+        nodes[min].height = nodes[node].height;
+        set_child_(c, path, dirs, top, min);
+        path[top] = min;
+    }
+    nodes[node].left = c->free_nodes;
+    c->free_nodes = node;
+    rebalance_path_(c, path, dirs, depth);
+}
+
+static void *compact_search_(const struct bstree *tree, const void *key)
+{
+    uint32_t node = find_(tree, key);
+    return node != NIL ? compact_(tree)->nodes[node].object : NULL;
+}
+
+static int compact_count_(const struct bstree *tree, const void *key)
+{
+    uint32_t node = find_(tree, key);
+    return node != NIL ? (int)compact_(tree)->nodes[node].count : 0;
+}
+
+static int traverse_(const struct cnode *nodes, uint32_t root, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    uint32_t i;
+    if (root == NIL) {
+        return 0;
+    }
+    if (traverse_(nodes, nodes[root].left, it_data, operation, cnt)) {
+        return 1;
+    }
+    for (i = 0; i < (cnt ? nodes[root].count : 1); i++) {
+        if (operation(nodes[root].object, it_data)) {
+            return 1;
+        }
+    }
+    return traverse_(nodes, nodes[root].right, it_data, operation, cnt);
+}
+
+static int compact_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    const struct compact *c = compact_(tree);
+    return traverse_(c->nodes, c->root, it_data, operation, cnt);
+}
+
+static int compact_size_(const struct bstree *tree)
+{
+    return compact_(tree)->size;
+}
+
+static long compact_size_cnt_(const struct bstree *tree)
+{
+    return compact_(tree)->size_cnt;
+}
+
+static int compact_height_(const struct bstree *tree)
+{
+    const struct compact *c = compact_(tree);
+    return c->nodes[c->root].height - 1;
+}
+
+static int free_object_(void *object, void *it_data)
+{
+    ((struct bstree_ops *)it_data)->free_object(object);
+    return 0;
+}
+
+static void compact_destroy_(struct bstree *tree)
+{
+    struct compact *c = compact_(tree);
+    if (tree->ops->free_object) {
+        traverse_(c->nodes, c->root, tree->ops, free_object_, 0);
+    }
+    free(c->nodes);
+    free(c);
+}
+
+static const struct bstree_backend compact_backend = {
+    compact_insert_,
+    compact_replace_,
+    compact_remove_,
+    compact_search_,
+    compact_count_,
+    compact_traverse_,
+    compact_size_,
+    compact_size_cnt_,
+    compact_height_,
+    compact_destroy_,
+    NULL,
+    compact_find_or_insert_
+};
+
+struct bstree *bstree_new_compact(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, free_object);
+    struct compact *c = malloc(sizeof *c);
+    c->capacity = MIN_CAPACITY;
+    c->nodes = malloc(c->capacity * sizeof *c->nodes);
+    c->nodes[NIL].object = NULL;
+    c->nodes[NIL].left = NIL;
+    c->nodes[NIL].right = NIL;
+    c->nodes[NIL].count = 0;
+    c->nodes[NIL].height = 0;
+    c->used = 1;
+    c->free_nodes = NIL;
+    c->root = NIL;
+    c->size = 0;
+    c->size_cnt = 0;
+    tree->ops->backend = &compact_backend;
+    tree->ops->impl = c;
+    return tree;
+}
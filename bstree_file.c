@@ -0,0 +1,358 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Trees saved to files, and mapped back into memory. A file holds a header,
+ * the entries of the tree in order, and the objects encoded by the user, each
+ * entry giving the offset of its object and its count. There are no pointers
+ * in the file, so it can be mapped anywhere as it is: lookups binary search
+ * the entries, handing the encoded objects right to compare_object.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_MAGIC "bstree\0\1"
+
+/* Objects are placed at offsets that are multiples of this */
+#define FILE_ALIGN 8
+
+struct file_header {
+    char magic[8];
+    uint64_t n;
+    uint64_t size_cnt;
+    /* Where the objects start, relative to the start of the file */
+    uint64_t data;
+    uint64_t length;
+};
+
+struct file_entry {
+    /* Relative to the start of the objects */
+    uint64_t offset;
+    uint32_t count;
+    uint32_t length;
+};
+
+struct mapped {
+    void *addr;
+    size_t length;
+    const struct file_entry *entries;
+    const char *data;
+    int n;
+    long size_cnt;
+};
+
+static size_t align_(size_t size)
+{
+    return (size + FILE_ALIGN - 1) / FILE_ALIGN * FILE_ALIGN;
+}
+
+/* The height of a perfectly balanced tree of n nodes, which is what binary
+ * searching the entries amounts to.
+ */
+static int height_(int n)
+{
+    int height = -1;
+    while (n > 0) {
+        height++;
+        n /= 2;
+    }
+    return height;
+}
+
+/* Write the n objects, which take sizes[i] bytes once encoded, with their
+ * counts.
+ */
+static int write_tree_(FILE *f, void **objects, const int *counts,
+        const size_t *sizes, int n,
+        size_t (*encode)(const void *object, void *buf))
+{
+    struct file_header header;
+    struct file_entry entry;
+    static const char pad[FILE_ALIGN];
+    void *buf;
+    size_t capacity = 1, offset = 0;
+    int i;
+    memcpy(header.magic, FILE_MAGIC, sizeof header.magic);
+    header.n = n;
+    header.size_cnt = 0;
+    header.data = sizeof header + n * sizeof entry;
+    for (i = 0; i < n; i++) {
+        header.size_cnt += counts[i];
+        offset += align_(sizes[i]);
+        if (sizes[i] > capacity) {
+            capacity = sizes[i];
+        }
+    }
+    header.length = offset;
+    if (fwrite(&header, sizeof header, 1, f) != 1) {
+        return -1;
+    }
+    offset = 0;
+    for (i = 0; i < n; i++) {
+        entry.offset = offset;
+        entry.count = counts[i];
+        entry.length = sizes[i];
+        if (fwrite(&entry, sizeof entry, 1, f) != 1) {
+            return -1;
+        }
+        offset += align_(entry.length);
+    }
+    buf = malloc(capacity);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        size_t size = sizes[i];
+        encode(objects[i], buf);
+        if (fwrite(buf, 1, size, f) != size
+                || fwrite(pad, 1, align_(size) - size, f)
+                != align_(size) - size) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/* Store the encoded size of each of the n objects in a new array, or return
+ * NULL with errno set if it cannot be allocated, or if a size does not fit
+ * the 32 bits of the entries. Counts, being ints, always fit.
+ */
+static size_t *encoded_sizes_(void **objects, int n,
+        size_t (*encode)(const void *object, void *buf))
+{
+    size_t *sizes = malloc((n + 1) * sizeof *sizes);
+    int i;
+    if (!sizes) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        sizes[i] = encode(objects[i], NULL);
+        if (sizes[i] > UINT32_MAX) {
+            free(sizes);
+            errno = EOVERFLOW;
+            return NULL;
+        }
+    }
+    return sizes;
+}
+
+int bstree_save(const struct bstree *tree, const char *path,
+        size_t (*encode)(const void *object, void *buf))
+{
+    void **objects;
+    int *counts;
+    size_t *sizes;
+    int n = bstree_gather(tree, &objects, &counts);
+    FILE *f;
+    int ret;
+    if (n < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sizes = encoded_sizes_(objects, n, encode);
+    f = sizes ? fopen(path, "wb") : NULL;
+    ret = f ? write_tree_(f, objects, counts, sizes, n, encode) : -1;
+    if (f && fclose(f)) {
+        ret = -1;
+    }
+    free(sizes);
+    free(counts);
+    free(objects);
+    return ret;
+}
+
+static struct mapped *mapped_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+/* Returns the index of the entry matching the key, or -1.
+ */
+static int find_(const struct bstree *tree, const void *key)
+{
+    const struct mapped *m = mapped_(tree);
+    int lo = 0, hi = m->n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2, cmp;
+        COUNT_(compare_calls);
+        cmp = tree->ops->compare_object(key, m->data + m->entries[mid].offset);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+static void *mapped_search_(const struct bstree *tree, const void *key)
+{
+    int i = find_(tree, key);
+    return i >= 0 ?
+        (void *)(mapped_(tree)->data + mapped_(tree)->entries[i].offset) :
+        NULL;
+}
+
+static int mapped_count_(const struct bstree *tree, const void *key)
+{
+    int i = find_(tree, key);
+    return i >= 0 ? (int)mapped_(tree)->entries[i].count : 0;
+}
+
+static int mapped_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    const struct mapped *m = mapped_(tree);
+    int i;
+    uint32_t j;
+    for (i = 0; i < m->n; i++) {
+        void *object = (void *)(m->data + m->entries[i].offset);
+        for (j = 0; j < (cnt ? m->entries[i].count : 1); j++) {
+            if (operation(object, it_data)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int mapped_size_(const struct bstree *tree)
+{
+    return mapped_(tree)->n;
+}
+
+static long mapped_size_cnt_(const struct bstree *tree)
+{
+    return mapped_(tree)->size_cnt;
+}
+
+static int mapped_height_(const struct bstree *tree)
+{
+    return height_(mapped_(tree)->n);
+}
+
+static void mapped_destroy_(struct bstree *tree)
+{
+    struct mapped *m = mapped_(tree);
+    munmap(m->addr, m->length);
+    free(m);
+}
+
+static const struct bstree_backend mapped_backend = {
+    bstree_read_only_insert,
+    bstree_read_only_insert,
+    bstree_read_only_remove,
+    mapped_search_,
+    mapped_count_,
+    mapped_traverse_,
+    mapped_size_,
+    mapped_size_cnt_,
+    mapped_height_,
+    mapped_destroy_,
+    NULL,
+    NULL
+};
+
+/* Check that the file holds what the header says, and that every entry
+ * points to an aligned object lying within the objects, returning 0 if so
+ * and -1 otherwise.
+ */
+static int check_file_(const void *addr, uint64_t size)
+{
+    struct file_header header;
+    const struct file_entry *entries;
+    uint64_t i;
+    memcpy(&header, addr, sizeof header);
+    if (memcmp(header.magic, FILE_MAGIC, sizeof header.magic)
+            || header.n > INT32_MAX
+            || header.data != sizeof header
+                + header.n * sizeof(struct file_entry)
+            || header.data > size
+            || header.length != size - header.data) {
+        return -1;
+    }
+    entries = (const struct file_entry *)((const char *)addr + sizeof header);
+    for (i = 0; i < header.n; i++) {
+        if (entries[i].offset % FILE_ALIGN
+                || entries[i].offset > header.length
+                || entries[i].length > header.length - entries[i].offset) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct bstree *bstree_mmap_load(const char *path,
+        int (*compare_object)(const void *lhs, const void *rhs))
+{
+    struct file_header header;
+    struct bstree *tree;
+    struct mapped *m;
+    struct stat st;
+    void *addr;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof header) {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    if (check_file_(addr, st.st_size)) {
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+    memcpy(&header, addr, sizeof header);
+    m = malloc(sizeof *m);
+    if (!m) {
+        munmap(addr, st.st_size);
+        return NULL;
+    }
+    m->addr = addr;
+    m->length = st.st_size;
+    m->entries = (const struct file_entry *)((char *)addr + sizeof header);
+    m->data = (const char *)addr + header.data;
+    m->n = header.n;
+    m->size_cnt = header.size_cnt;
+    tree = bstree_new(compare_object, NULL);
+    tree->ops->backend = &mapped_backend;
+    tree->ops->impl = m;
+    return tree;
+}
@@ -0,0 +1,251 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Frozen backend: a read only copy of a tree, laid out for searching. The
+ * objects are kept twice, once in order, for traversals, and once in the
+ * order a breadth first walk of a perfectly balanced tree would visit them
+ * (the Eytzinger layout), for searches. In the latter, the children of the
+ * element at index i (counting from 1) are at 2i and 2i + 1, so the first
+ * levels of every search share the same few cache lines, and the next index
+ * is computed from the comparison instead of branched to. For keyed trees the
+ * key prefixes are laid out the same way, and compared inline.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct frozen {
+    int n;
+    long size_cnt;
+    /* In order */
+    void **objects;
+    int *counts;
+    /* In Eytzinger order, index 0 being unused */
+    void **layout;
+    uint64_t *keys;
+    int *positions;
+};
+
+static struct frozen *frozen_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+/* Lay out the subtree rooted at index i, the objects from position k on
+ * going into it, and return the position of the first one left.
+ */
+static int fill_(struct frozen *f, const struct bstree_ops *ops, size_t i,
+        int k)
+{
+    if (i <= (size_t)f->n) {
+        k = fill_(f, ops, 2 * i, k);
+        f->layout[i] = f->objects[k];
+        f->positions[i] = k;
+        if (f->keys) {
+            f->keys[i] = ops->key_object(f->objects[k]);
+        }
+        k = fill_(f, ops, 2 * i + 1, k + 1);
+    }
+    return k;
+}
+
+/* Every comparison goes through here, to be counted for bstree_stats */
+static int compare_(const struct bstree_ops *ops, const void *key,
+        const void *object)
+{
+    COUNT_(compare_calls);
+    return ops->compare_object(key, object);
+}
+
+/* Return the position of the first object not less than the key, n if there
+ * is none. Going left on the less-or-equal side, the index ends up past the
+ * leaves with the path taken in its bits, and the last time we went left is
+ * where the answer is, found by dropping the trailing right turns (ones) and
+ * the left turn before them.
+ */
+static int lower_bound_(const struct bstree *tree, const void *key)
+{
+    const struct frozen *f = frozen_(tree);
+    unsigned long i = 1, n = f->n;
+    if (f->keys) {
+        uint64_t prefix = tree->ops->key_object(key);
+        while (i <= n) {
+            uint64_t k = f->keys[i];
+            if (16 * i <= n) {
+                __builtin_prefetch(f->keys + 16 * i);
+            }
+            i = 2 * i + (k < prefix || (k == prefix &&
+                        compare_(tree->ops, key, f->layout[i]) > 0));
+        }
+    } else {
+        /* Without prefixes every step waits for an object to be loaded, so
+         * start loading the four the next two steps may need, as we know
+         * where they are before knowing which way we go.
+         */
+        while (i <= n) {
+            if (4 * i + 3 <= n) {
+                __builtin_prefetch(f->layout[4 * i]);
+                __builtin_prefetch(f->layout[4 * i + 1]);
+                __builtin_prefetch(f->layout[4 * i + 2]);
+                __builtin_prefetch(f->layout[4 * i + 3]);
+            }
+            i = 2 * i + (compare_(tree->ops, key, f->layout[i]) > 0);
+        }
+    }
+    i >>= __builtin_ffsl(~i);
+    return i ? f->positions[i] : f->n;
+}
+
+/* Return the position of the object matching the key, or -1.
+ */
+static int find_(const struct bstree *tree, const void *key)
+{
+    const struct frozen *f = frozen_(tree);
+    int k = lower_bound_(tree, key);
+    return k < f->n && !compare_(tree->ops, key, f->objects[k]) ? k : -1;
+}
+
+static void *frozen_search_(const struct bstree *tree, const void *key)
+{
+    int k = find_(tree, key);
+    return k >= 0 ? frozen_(tree)->objects[k] : NULL;
+}
+
+static int frozen_count_(const struct bstree *tree, const void *key)
+{
+    int k = find_(tree, key);
+    return k >= 0 ? frozen_(tree)->counts[k] : 0;
+}
+
+/* Traverse the objects at positions [first, last) */
+static int traverse_(const struct frozen *f, int first, int last,
+        void *it_data, int (*operation)(void *object, void *it_data), int cnt)
+{
+    int k, i;
+    for (k = first; k < last; k++) {
+        for (i = 0; i < (cnt ? f->counts[k] : 1); i++) {
+            if (operation(f->objects[k], it_data)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int frozen_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    const struct frozen *f = frozen_(tree);
+    return traverse_(f, 0, f->n, it_data, operation, cnt);
+}
+
+static int frozen_traverse_range_(const struct bstree *tree, const void *lo,
+        const void *hi, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    const struct frozen *f = frozen_(tree);
+    return traverse_(f, lo ? lower_bound_(tree, lo) : 0,
+            hi ? lower_bound_(tree, hi) : f->n, it_data, operation, cnt);
+}
+
+static int frozen_size_(const struct bstree *tree)
+{
+    return frozen_(tree)->n;
+}
+
+static long frozen_size_cnt_(const struct bstree *tree)
+{
+    return frozen_(tree)->size_cnt;
+}
+
+static int frozen_height_(const struct bstree *tree)
+{
+    int n = frozen_(tree)->n, height = -1;
+    while (n > 0) {
+        height++;
+        n /= 2;
+    }
+    return height;
+}
+
+static void frozen_destroy_(struct bstree *tree)
+{
+    struct frozen *f = frozen_(tree);
+    free(f->objects);
+    free(f->counts);
+    free(f->layout);
+    free(f->keys);
+    free(f->positions);
+    free(f);
+}
+
+static const struct bstree_backend frozen_backend = {
+    bstree_read_only_insert,
+    bstree_read_only_insert,
+    bstree_read_only_remove,
+    frozen_search_,
+    frozen_count_,
+    frozen_traverse_,
+    frozen_size_,
+    frozen_size_cnt_,
+    frozen_height_,
+    frozen_destroy_,
+    frozen_traverse_range_,
+    NULL
+};
+
+struct bstree *bstree_freeze(const struct bstree *tree)
+{
+    const struct bstree_ops *ops = tree->ops;
+    struct bstree *frozen;
+    struct frozen *f = malloc(sizeof *f);
+    int k;
+    if (!f) {
+        return NULL;
+    }
+    f->n = bstree_gather(tree, &f->objects, &f->counts);
+    if (f->n < 0) {
+        free(f);
+        return NULL;
+    }
+    f->layout = malloc((f->n + 1) * sizeof *f->layout);
+    f->keys = ops->key_object ? malloc((f->n + 1) * sizeof *f->keys) : NULL;
+    f->positions = malloc((f->n + 1) * sizeof *f->positions);
+    if (!f->layout || (ops->key_object && !f->keys) || !f->positions) {
+        free(f->positions);
+        free(f->keys);
+        free(f->layout);
+        free(f->counts);
+        free(f->objects);
+        free(f);
+        return NULL;
+    }
+    frozen = bstree_new(ops->compare_object, NULL);
+    f->size_cnt = 0;
+    for (k = 0; k < f->n; k++) {
+        f->size_cnt += f->counts[k];
+    }
+    fill_(f, ops, 1, 0);
+    frozen->ops->key_object = ops->key_object;
+    frozen->ops->backend = &frozen_backend;
+    frozen->ops->impl = f;
+    return frozen;
+}
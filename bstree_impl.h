@@ -0,0 +1,121 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BSTREE_IMPL_H
+#define BSTREE_IMPL_H
+
+/* Definitions shared between the parts of the implementation, not meant to
+ * be included by users of the tree.
+ */
+
+#include "bstree.h"
+
+#include <stdint.h>
+
+/* Built with BSTREE_STATS defined, the hot paths count what they do into
+ * counters shared by all the trees, for bstree_stats. The counters are
+ * updated atomically, as the parallel operations and the readers of shared
+ * trees count from several threads. Otherwise counting compiles to nothing.
+ */
+#ifdef BSTREE_STATS
+struct bstree_counters {
+    long compare_calls;
+    long single_rotations;
+    long double_rotations;
+    long nodes_allocated;
+    long nodes_freed;
+};
+
+extern struct bstree_counters bstree_counters_;
+
+#define COUNT_N_(counter, n) \
+    __atomic_fetch_add(&bstree_counters_.counter, (n), __ATOMIC_RELAXED)
+#else
+#define COUNT_N_(counter, n) ((void)0)
+#endif
+
+#define COUNT_(counter) COUNT_N_(counter, 1)
+
+struct bstree_ops {
+    int (*compare_object)(const void *lhs, const void *rhs);
+    /* If the user supplies a function to free the objects, then we know that
+     * we take the ownership of the resources, and we should eventually
+     * free every pointer we are given if we are still holding it in the end.
+     * If the freeing function is NULL, we just keep the pointers to the
+     * objects and never free them, that means the user manages the lifetime.
+     */
+    void (*free_object)(void *object);
+    /* NULL unless the tree was made with bstree_new_keyed */
+    uint64_t (*key_object)(const void *object);
+    /* NULL unless the tree was made with bstree_new_pooled */
+    struct bstree_pool *pool;
+    /* Trees not using the default node layout have their operations
+     * dispatched to a backend, which keeps its own state in impl. For those
+     * trees, root is always NULL.
+     */
+    const struct bstree_backend *backend;
+    void *impl;
+    /* Set by bstree_set_threads */
+    int threads;
+    /* NULL unless set by bstree_set_cache */
+    struct bstree_cache *cache;
+};
+
+/* The operations a backend has to provide. They mirror the interface
+ * functions of the same name, traverse doing the work of both
+ * bstree_traverse_inorder and bstree_traverse_inorder_cnt, and traverse_range
+ * that of both range traversals. Destroy has to get rid of the objects (if
+ * they are owned by the tree) and of impl, the rest is taken care of by
+ * bstree_destroy. The operations after destroy are optional, and may be left
+ * NULL. Read-only backends leave find_or_insert NULL, and use the stubs below
+ * for the other updates.
+ */
+struct bstree_backend {
+    void (*insert)(struct bstree *tree, void *object);
+    void (*replace)(struct bstree *tree, void *object);
+    void (*remove)(struct bstree *tree, const void *key);
+    void *(*search)(const struct bstree *tree, const void *key);
+    int (*count)(const struct bstree *tree, const void *key);
+    int (*traverse)(const struct bstree *tree, void *it_data,
+            int (*operation)(void *object, void *it_data), int cnt);
+    int (*size)(const struct bstree *tree);
+    long (*size_cnt)(const struct bstree *tree);
+    int (*height)(const struct bstree *tree);
+    void (*destroy)(struct bstree *tree);
+    int (*traverse_range)(const struct bstree *tree, const void *lo,
+            const void *hi, void *it_data,
+            int (*operation)(void *object, void *it_data), int cnt);
+    void *(*find_or_insert)(struct bstree *tree, const void *key,
+            void *(*make_object)(const void *key));
+};
+
+/* Store the objects of any tree in order in a new array put in objects, and
+ * their counts in one put in counts, returning their number, or -1 if the
+ * arrays cannot be allocated. The objects are taken in a single traversal,
+ * which sees one version of a tree shared between threads however long the
+ * arrays turn out to be. The caller frees both arrays.
+ */
+int bstree_gather(const struct bstree *tree, void ***objects, int **counts);
+
+/* The insert (and replace) and remove operations of read-only backends,
+ * which do nothing.
+ */
+void bstree_read_only_insert(struct bstree *tree, void *object);
+void bstree_read_only_remove(struct bstree *tree, const void *key);
+
+#endif
@@ -0,0 +1,812 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* RCU backend: readers never take a lock, nor wait for the writer. A node
+ * that is part of the published tree is never modified. Updates, done one at
+ * a time under a mutex, copy the nodes they have to change (the path from the
+ * root down to where the change happens, and the few nodes rotations move
+ * around), and publish the new version of the tree by storing its root
+ * atomically. Readers work on whichever version they found when they started.
+ *
+ * As the nodes not on the path are shared between versions, each node counts
+ * the references to it: one per node (of any version) or root pointing at
+ * it. The root replaced by an update is retired, and its reference dropped
+ * once no reader can hold it anymore, freeing the nodes only it had. A
+ * snapshot is one more reference to the root, which keeps its version alive.
+ *
+ * Readers announce themselves by counting up one of two counters of their
+ * slot, the one the parity of the current epoch selects. To know all the
+ * readers that could have seen a retired root are gone, the writer moves to
+ * the next epoch and waits for the counters of the previous parity to drop to
+ * zero, twice, as a reader may have read the epoch before the first move but
+ * counted itself up after the writer looked at its slot. Spreading the
+ * counters over slots keeps readers on different cores from fighting over
+ * one cache line.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+
+#define MAX_IMBALANCE 1
+
+/* The number of reader slots, threads take them round robin */
+#define READER_SLOTS 64
+
+/* Retired roots and objects are freed in batches of at least this many, each
+ * batch waiting for the readers once.
+ */
+#define RETIRE_BATCH 1024
+
+struct rnode {
+    struct rnode *left;
+    struct rnode *right;
+    void *object;
+    int count;
+    int height;
+    int refs;
+    /* The update that made the node. The writer may modify the nodes it
+     * made itself in place, as no reader can see them yet.
+     */
+    unsigned long version;
+    /* The update that put the object in the tree, copied along with it */
+    unsigned long born;
+};
+
+struct slot {
+    long readers[2];
+} __attribute__((aligned(64)));
+
+/* A root, or an object, waiting to be freed. Objects were in the versions
+ * from born up to the one before died, roots leave both 0.
+ */
+struct retiree {
+    void *item;
+    unsigned long born;
+    unsigned long died;
+};
+
+struct retired {
+    struct retiree *items;
+    int n;
+    int capacity;
+};
+
+/* Snapshots are trees of their own, sharing the nodes of the version they
+ * were taken of, but never updated. The tree keeps those not destroyed yet
+ * in a list, by increasing version.
+ */
+struct snapshot {
+    const struct bstree *origin;
+    struct rnode *root;
+    unsigned long version;
+    struct snapshot *prev;
+    struct snapshot *next;
+    int size;
+    long size_cnt;
+};
+
+struct rcu {
+    struct slot slots[READER_SLOTS];
+    struct rnode *root;
+    unsigned long epoch;
+    pthread_mutex_t writer;
+    unsigned long version;
+    struct retired roots;
+    struct retired objects;
+    /* The number of objects the last reclaim_ had to keep for snapshots */
+    int kept;
+    /* Guarded by the writer lock, like the rest of the updates */
+    struct snapshot *first_snapshot;
+    struct snapshot *last_snapshot;
+    int size;
+    long size_cnt;
+};
+
+static struct rcu *rcu_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+static int slot_(void)
+{
+    static int next_slot;
+    static __thread int slot = -1;
+    if (slot < 0) {
+        slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+            READER_SLOTS;
+    }
+    return slot;
+}
+
+static int read_lock_(struct rcu *r)
+{
+    int parity = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&r->slots[slot_()].readers[parity], 1,
+            __ATOMIC_SEQ_CST);
+    return parity;
+}
+
+static void read_unlock_(struct rcu *r, int parity)
+{
+    __atomic_fetch_sub(&r->slots[slot_()].readers[parity], 1,
+            __ATOMIC_RELEASE);
+}
+
+/* Wait until every reader that might have seen a retired node is done.
+ */
+static void synchronize_(struct rcu *r)
+{
+    int pass, i;
+    for (pass = 0; pass < 2; pass++) {
+        int parity = __atomic_fetch_add(&r->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for (i = 0; i < READER_SLOTS; i++) {
+            while (__atomic_load_n(&r->slots[i].readers[parity],
+                        __ATOMIC_SEQ_CST)) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+static void retire_(struct retired *retired, void *item,
+        unsigned long born, unsigned long died)
+{
+    if (retired->n == retired->capacity) {
+        retired->capacity = retired->capacity ? retired->capacity * 2 :
+            RETIRE_BATCH;
+        retired->items = realloc(retired->items,
+                retired->capacity * sizeof *retired->items);
+    }
+    retired->items[retired->n].item = item;
+    retired->items[retired->n].born = born;
+    retired->items[retired->n].died = died;
+    retired->n++;
+}
+
+static struct rnode *ref_(struct rnode *node)
+{
+    if (node) {
+        __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+    }
+    return node;
+}
+
+/* Drop a reference to a node that is still referenced from elsewhere.
+ */
+static void put_(struct rnode *node)
+{
+    __atomic_fetch_sub(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to a node that no reader can reach through it anymore,
+ * freeing the node if it was the last one.
+ */
+static void unref_(struct rnode *node)
+{
+    if (node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        unref_(node->left);
+        unref_(node->right);
+        free(node);
+    }
+}
+
+/* Whether a snapshot holds the retired object, which it does if it was
+ * taken of one of the versions the object was in.
+ */
+static int in_snapshot_(const struct rcu *r, const struct retiree *object)
+{
+    const struct snapshot *snap;
+    for (snap = r->first_snapshot; snap; snap = snap->next) {
+        if (snap->version >= object->born) {
+            return snap->version < object->died;
+        }
+    }
+    return 0;
+}
+
+/* Free the retired roots, and the retired objects no snapshot holds. The
+ * caller holds the writer lock.
+ */
+static void reclaim_(const struct bstree *tree)
+{
+    struct rcu *r = rcu_(tree);
+    int i, kept = 0;
+    synchronize_(r);
+    for (i = 0; i < r->roots.n; i++) {
+        unref_(r->roots.items[i].item);
+    }
+    r->roots.n = 0;
+    for (i = 0; i < r->objects.n; i++) {
+        if (in_snapshot_(r, &r->objects.items[i])) {
+            r->objects.items[kept++] = r->objects.items[i];
+        } else {
+            tree->ops->free_object(r->objects.items[i].item);
+        }
+    }
+    r->objects.n = r->kept = kept;
+}
+
+static int height_(const struct rnode *root)
+{
+    return root ? root->height : -1;
+}
+
+static void update_(struct rnode *root)
+{
+    root->height = MAX(height_(root->left), height_(root->right)) + 1;
+}
+
+static int imbalance_(const struct rnode *root)
+{
+    return height_(root->left) - height_(root->right);
+}
+
+/* Return a node the writer may modify in place of the given one: the node
+ * itself if it was made by the current update, a copy of it otherwise. The
+ * reference the caller had to the node moves to the copy.
+ */
+static struct rnode *own_(struct rcu *r, struct rnode *node)
+{
+    struct rnode *copy;
+    if (node->version == r->version) {
+        return node;
+    }
+    /* Not a plain struct copy, as a snapshot being destroyed may be
+     * dropping its reference to the node at the same time
+     */
+    copy = malloc(sizeof *copy);
+    copy->left = node->left;
+    copy->right = node->right;
+    copy->object = node->object;
+    copy->count = node->count;
+    copy->height = node->height;
+    copy->refs = 1;
+    copy->version = r->version;
+    copy->born = node->born;
+    ref_(copy->left);
+    ref_(copy->right);
+    put_(node);
+    return copy;
+}
+
+/* The rotations and balance_ are the ones of bstree.c, except that the root
+ * given has to be owned already, and the nodes moved are owned first. Moving
+ * pointers around between owned nodes leaves the references as they are.
+ */
+static struct rnode *rotate_with_left_(struct rcu *r, struct rnode *root)
+{
+    struct rnode *newroot = own_(r, root->left);
+    root->left = newroot->right;
+    newroot->right = root;
+    update_(root);
+    update_(newroot);
+    return newroot;
+}
+
+static struct rnode *rotate_with_right_(struct rcu *r, struct rnode *root)
+{
+    struct rnode *newroot = own_(r, root->right);
+    root->right = newroot->left;
+    newroot->left = root;
+    update_(root);
+    update_(newroot);
+    return newroot;
+}
+
+static struct rnode *balance_(struct rcu *r, struct rnode *root)
+{
+    if (imbalance_(root) > MAX_IMBALANCE) {
+        if (imbalance_(root->left) < 0) {
+            COUNT_(double_rotations);
+            root->left = rotate_with_right_(r, own_(r, root->left));
+        } else {
+            COUNT_(single_rotations);
+        }
+        return rotate_with_left_(r, root);
+    }
+    if (imbalance_(root) < -MAX_IMBALANCE) {
+        if (imbalance_(root->right) > 0) {
+            COUNT_(double_rotations);
+            root->right = rotate_with_left_(r, own_(r, root->right));
+        } else {
+            COUNT_(single_rotations);
+        }
+        return rotate_with_right_(r, root);
+    }
+    update_(root);
+    return root;
+}
+
+static void rebalance_path_(struct rcu *r, struct rnode **path[], int depth)
+{
+    while (depth-- > 0) {
+        struct rnode **link = path[depth];
+        int height = (*link)->height;
+        *link = balance_(r, *link);
+        if ((*link)->height == height) {
+            return;
+        }
+    }
+}
+
+/* Find the node matching the key in the published tree, without copying
+ * anything, recording which child was taken at each level in dirs, 0 for the
+ * left one and 1 for the right one.
+ */
+static struct rnode *find_path_(const struct bstree *tree, const void *key,
+        int dirs[], int *depth)
+{
+    struct rnode *root = rcu_(tree)->root;
+    *depth = 0;
+    while (root) {
+        int cmp;
+        COUNT_(compare_calls);
+        cmp = tree->ops->compare_object(key, root->object);
+        if (cmp == 0) {
+            break;
+        }
+        dirs[(*depth)++] = cmp > 0;
+        root = cmp > 0 ? root->right : root->left;
+    }
+    return root;
+}
+
+/* Own the nodes on the path find_path_ recorded, starting from the given
+ * root (which the caller holds a reference to), and return the link to what
+ * is at the end of it, with the links leading there in path.
+ */
+static struct rnode **copy_path_(struct rcu *r, struct rnode **root,
+        const int dirs[], int depth, struct rnode **path[])
+{
+    struct rnode **link = root;
+    int i;
+    for (i = 0; i < depth; i++) {
+        *link = own_(r, *link);
+        path[i] = link;
+        link = dirs[i] ? &(*link)->right : &(*link)->left;
+    }
+    return link;
+}
+
+/* Make root, the reference to which the caller gives away, the published
+ * one.
+ */
+static void publish_(const struct bstree *tree, struct rnode *root)
+{
+    struct rcu *r = rcu_(tree);
+    if (r->root) {
+        retire_(&r->roots, r->root, 0, 0);
+    }
+    __atomic_store_n(&r->root, root, __ATOMIC_SEQ_CST);
+    /* The objects kept by the last reclaim_ are not counted, so that they
+     * do not make every update reclaim again
+     */
+    if (r->roots.n + r->objects.n - r->kept >= RETIRE_BATCH) {
+        reclaim_(tree);
+    }
+}
+
+/* Insert the object, or if make_object is given, the one it makes for the
+ * key when there is no equal object yet, and return the object left in the
+ * tree for the key. The caller holds the writer lock.
+ */
+static void *insert_(struct bstree *tree, const void *key, void *object,
+        void *(*make_object)(const void *key), int replace)
+{
+    struct rcu *r = rcu_(tree);
+    struct rnode **path[BSTREE_MAX_HEIGHT];
+    int dirs[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct rnode *root, **link, *node;
+    node = find_path_(tree, key, dirs, &depth);
+    if (node && make_object) {
+        return node->object;
+    }
+    if (make_object) {
+        object = make_object(key);
+    }
+    r->version++;
+    root = ref_(r->root);
+    link = copy_path_(r, &root, dirs, depth, path);
+    if (*link) {
+        /* Equal key, same as in insert_ and replace_ of bstree.c */
+        *link = own_(r, *link);
+        if (replace) {
+            if (tree->ops->free_object) {
+                retire_(&r->objects, (*link)->object, (*link)->born,
+                        r->version);
+            }
+            (*link)->object = object;
+            (*link)->born = r->version;
+        } else {
+            (*link)->count++;
+            __atomic_store_n(&r->size_cnt, r->size_cnt + 1,
+                    __ATOMIC_RELAXED);
+            if (tree->ops->free_object) {
+                tree->ops->free_object(object);
+            }
+            object = (*link)->object;
+        }
+    } else {
+        *link = malloc(sizeof **link);
+        (*link)->left = NULL;
+        (*link)->right = NULL;
+        (*link)->object = object;
+        (*link)->count = 1;
+        (*link)->height = 0;
+        (*link)->refs = 1;
+        (*link)->version = r->version;
+        (*link)->born = r->version;
+        __atomic_store_n(&r->size, r->size + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->size_cnt, r->size_cnt + 1, __ATOMIC_RELAXED);
+        rebalance_path_(r, path, depth);
+    }
+    publish_(tree, root);
+    return object;
+}
+
+static void rcu_insert_(struct bstree *tree, void *object)
+{
+    struct rcu *r = rcu_(tree);
+    pthread_mutex_lock(&r->writer);
+    insert_(tree, object, object, NULL, 0);
+    pthread_mutex_unlock(&r->writer);
+}
+
+static void rcu_replace_(struct bstree *tree, void *object)
+{
+    struct rcu *r = rcu_(tree);
+    pthread_mutex_lock(&r->writer);
+    insert_(tree, object, object, NULL, 1);
+    pthread_mutex_unlock(&r->writer);
+}
+
+static void *rcu_find_or_insert_(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key))
+{
+    struct rcu *r = rcu_(tree);
+    void *object;
+    pthread_mutex_lock(&r->writer);
+    object = insert_(tree, key, NULL, make_object, 0);
+    pthread_mutex_unlock(&r->writer);
+    return object;
+}
+
+static void rcu_remove_(struct bstree *tree, const void *key)
+{
+    struct rcu *r = rcu_(tree);
+    struct rnode **path[BSTREE_MAX_HEIGHT];
+    int dirs[BSTREE_MAX_HEIGHT];
+    int depth;
+    struct rnode *root, **link, *node;
+    pthread_mutex_lock(&r->writer);
+    if (!find_path_(tree, key, dirs, &depth)) {
+        pthread_mutex_unlock(&r->writer);
+        return;
+    }
+    r->version++;
+    root = ref_(r->root);
+    link = copy_path_(r, &root, dirs, depth, path);
+    node = *link;
+    if (!node->left || !node->right) {
+        *link = ref_(node->left ? node->left : node->right);
+    } else {
+        /* Put a copy of the minimum of the right subtree in place of the
+         * node
+         */
+        int top = depth;
+        struct rnode *right = ref_(node->right), **min_link = &right, *min;
+        path[depth++] = link;
+        while ((*min_link)->left) {
+            *min_link = own_(r, *min_link);
+            path[depth++] = min_link;
+            min_link = &(*min_link)->left;
+        }
+        min = own_(r, *min_link);
+        *min_link = min->right;
+        min->left = ref_(node->left);
+        min->right = right;
+        min->height = node->height;
+        *link = min;
+        if (depth > top + 1) {
+            path[top + 1] = &min->right;
+        }
+    }
+    put_(node);
+    if (tree->ops->free_object) {
+        retire_(&r->objects, node->object, node->born, r->version);
+    }
+    __atomic_store_n(&r->size, r->size - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->size_cnt, r->size_cnt - node->count,
+            __ATOMIC_RELAXED);
+    rebalance_path_(r, path, depth);
+    publish_(tree, root);
+    pthread_mutex_unlock(&r->writer);
+}
+
+static const struct rnode *find_(const struct bstree *tree,
+        const struct rnode *root, const void *key)
+{
+    while (root) {
+        int cmp;
+        COUNT_(compare_calls);
+        cmp = tree->ops->compare_object(key, root->object);
+        if (cmp < 0) {
+            root = root->left;
+        } else if (cmp > 0) {
+            root = root->right;
+        } else {
+            break;
+        }
+    }
+    return root;
+}
+
+static void *rcu_search_(const struct bstree *tree, const void *key)
+{
+    struct rcu *r = rcu_(tree);
+    int parity = read_lock_(r);
+    const struct rnode *node = find_(tree,
+            __atomic_load_n(&r->root, __ATOMIC_SEQ_CST), key);
+    void *object = node ? node->object : NULL;
+    read_unlock_(r, parity);
+    return object;
+}
+
+static int rcu_count_(const struct bstree *tree, const void *key)
+{
+    struct rcu *r = rcu_(tree);
+    int parity = read_lock_(r);
+    const struct rnode *node = find_(tree,
+            __atomic_load_n(&r->root, __ATOMIC_SEQ_CST), key);
+    int count = node ? node->count : 0;
+    read_unlock_(r, parity);
+    return count;
+}
+
+static int traverse_(const struct rnode *root, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    int i;
+    if (!root) {
+        return 0;
+    }
+    if (traverse_(root->left, it_data, operation, cnt)) {
+        return 1;
+    }
+    for (i = 0; i < (cnt ? root->count : 1); i++) {
+        if (operation(root->object, it_data)) {
+            return 1;
+        }
+    }
+    return traverse_(root->right, it_data, operation, cnt);
+}
+
+static int rcu_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    struct rcu *r = rcu_(tree);
+    int parity = read_lock_(r);
+    int ret = traverse_(__atomic_load_n(&r->root, __ATOMIC_SEQ_CST), it_data,
+            operation, cnt);
+    read_unlock_(r, parity);
+    return ret;
+}
+
+static int rcu_size_(const struct bstree *tree)
+{
+    return __atomic_load_n(&rcu_(tree)->size, __ATOMIC_RELAXED);
+}
+
+static long rcu_size_cnt_(const struct bstree *tree)
+{
+    return __atomic_load_n(&rcu_(tree)->size_cnt, __ATOMIC_RELAXED);
+}
+
+static int rcu_height_(const struct bstree *tree)
+{
+    struct rcu *r = rcu_(tree);
+    int parity = read_lock_(r);
+    int height = height_(__atomic_load_n(&r->root, __ATOMIC_SEQ_CST));
+    read_unlock_(r, parity);
+    return height;
+}
+
+static int free_object_(void *object, void *it_data)
+{
+    ((struct bstree_ops *)it_data)->free_object(object);
+    return 0;
+}
+
+static void rcu_destroy_(struct bstree *tree)
+{
+    struct rcu *r = rcu_(tree);
+    reclaim_(tree);
+    if (tree->ops->free_object) {
+        traverse_(r->root, tree->ops, free_object_, 0);
+    }
+    unref_(r->root);
+    free(r->roots.items);
+    free(r->objects.items);
+    pthread_mutex_destroy(&r->writer);
+    free(r);
+}
+
+static const struct bstree_backend rcu_backend = {
+    rcu_insert_,
+    rcu_replace_,
+    rcu_remove_,
+    rcu_search_,
+    rcu_count_,
+    rcu_traverse_,
+    rcu_size_,
+    rcu_size_cnt_,
+    rcu_height_,
+    rcu_destroy_,
+    NULL,
+    rcu_find_or_insert_
+};
+
+struct bstree *bstree_new_rcu(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, free_object);
+    struct rcu *r = aligned_alloc(64, sizeof *r);
+    int i;
+    for (i = 0; i < READER_SLOTS; i++) {
+        r->slots[i].readers[0] = 0;
+        r->slots[i].readers[1] = 0;
+    }
+    r->root = NULL;
+    r->epoch = 0;
+    pthread_mutex_init(&r->writer, NULL);
+    r->version = 0;
+    r->roots.items = NULL;
+    r->roots.n = r->roots.capacity = 0;
+    r->objects.items = NULL;
+    r->objects.n = r->objects.capacity = 0;
+    r->kept = 0;
+    r->first_snapshot = NULL;
+    r->last_snapshot = NULL;
+    r->size = 0;
+    r->size_cnt = 0;
+    tree->ops->backend = &rcu_backend;
+    tree->ops->impl = r;
+    return tree;
+}
+
+int bstree_rcu_read_lock(const struct bstree *tree)
+{
+    return read_lock_(rcu_(tree));
+}
+
+void bstree_rcu_read_unlock(const struct bstree *tree, int token)
+{
+    read_unlock_(rcu_(tree), token);
+}
+
+static struct snapshot *snapshot_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+static void *snapshot_search_(const struct bstree *tree, const void *key)
+{
+    const struct rnode *node = find_(tree, snapshot_(tree)->root, key);
+    return node ? node->object : NULL;
+}
+
+static int snapshot_count_(const struct bstree *tree, const void *key)
+{
+    const struct rnode *node = find_(tree, snapshot_(tree)->root, key);
+    return node ? node->count : 0;
+}
+
+static int snapshot_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    return traverse_(snapshot_(tree)->root, it_data, operation, cnt);
+}
+
+static int snapshot_size_(const struct bstree *tree)
+{
+    return snapshot_(tree)->size;
+}
+
+static long snapshot_size_cnt_(const struct bstree *tree)
+{
+    return snapshot_(tree)->size_cnt;
+}
+
+static int snapshot_height_(const struct bstree *tree)
+{
+    return height_(snapshot_(tree)->root);
+}
+
+static void snapshot_destroy_(struct bstree *tree)
+{
+    struct snapshot *snap = snapshot_(tree);
+    struct rcu *r = rcu_(snap->origin);
+    unref_(snap->root);
+    pthread_mutex_lock(&r->writer);
+    if (snap->prev) {
+        snap->prev->next = snap->next;
+    } else {
+        r->first_snapshot = snap->next;
+    }
+    if (snap->next) {
+        snap->next->prev = snap->prev;
+    } else {
+        r->last_snapshot = snap->prev;
+    }
+    pthread_mutex_unlock(&r->writer);
+    free(snap);
+}
+
+static const struct bstree_backend snapshot_backend = {
+    bstree_read_only_insert,
+    bstree_read_only_insert,
+    bstree_read_only_remove,
+    snapshot_search_,
+    snapshot_count_,
+    snapshot_traverse_,
+    snapshot_size_,
+    snapshot_size_cnt_,
+    snapshot_height_,
+    snapshot_destroy_,
+    NULL,
+    NULL
+};
+
+struct bstree *bstree_snapshot(const struct bstree *tree)
+{
+    struct rcu *r;
+    struct bstree *copy;
+    struct snapshot *snap;
+    if (tree->ops->backend != &rcu_backend) {
+        return NULL;
+    }
+    r = rcu_(tree);
+    copy = bstree_new(tree->ops->compare_object, NULL);
+    snap = malloc(sizeof *snap);
+    snap->origin = tree;
+    pthread_mutex_lock(&r->writer);
+    snap->root = ref_(r->root);
+    snap->size = r->size;
+    snap->size_cnt = r->size_cnt;
+    snap->version = r->version;
+    snap->prev = r->last_snapshot;
+    snap->next = NULL;
+    if (r->last_snapshot) {
+        r->last_snapshot->next = snap;
+    } else {
+        r->first_snapshot = snap;
+    }
+    r->last_snapshot = snap;
+    pthread_mutex_unlock(&r->writer);
+    copy->ops->backend = &snapshot_backend;
+    copy->ops->impl = snap;
+    return copy;
+}
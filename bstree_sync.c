@@ -0,0 +1,225 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Synchronized backend: the tree is an ordinary one, guarded by a reader-writer
+ * lock. Searches, counts, traversals and size queries take the read side and
+ * may run in parallel, insertion, replacement and removal take the write side.
+ *
+ * The lock prefers writers where it can, so that a steady stream of readers
+ * does not starve them, which makes a read lock wait behind a waiting writer
+ * even in a thread already holding one. As the operation of a traversal may
+ * well look things up in the tree it traverses, each thread keeps the trees
+ * it holds the read side of in a list, and does not lock them again.
+ */
+
+#include "bstree.h"
+#include "bstree_impl.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+struct sync {
+    pthread_rwlock_t lock;
+    struct bstree *tree;
+};
+
+/* A read lock of the calling thread, s being NULL for nested ones, which
+ * did not lock.
+ */
+struct held {
+    struct sync *s;
+    struct held *next;
+};
+
+/* The read locks the calling thread holds, innermost first */
+static __thread struct held *held_;
+
+static struct sync *sync_(const struct bstree *tree)
+{
+    return tree->ops->impl;
+}
+
+static void read_lock_(struct sync *s, struct held *h)
+{
+    struct held *p;
+    for (p = held_; p && p->s != s; p = p->next);
+    h->s = p ? NULL : s;
+    if (!p) {
+        pthread_rwlock_rdlock(&s->lock);
+    }
+    h->next = held_;
+    held_ = h;
+}
+
+static void read_unlock_(struct held *h)
+{
+    held_ = h->next;
+    if (h->s) {
+        pthread_rwlock_unlock(&h->s->lock);
+    }
+}
+
+static void sync_insert_(struct bstree *tree, void *object)
+{
+    struct sync *s = sync_(tree);
+    pthread_rwlock_wrlock(&s->lock);
+    bstree_insert(s->tree, object);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+static void sync_replace_(struct bstree *tree, void *object)
+{
+    struct sync *s = sync_(tree);
+    pthread_rwlock_wrlock(&s->lock);
+    bstree_replace(s->tree, object);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+static void *sync_find_or_insert_(struct bstree *tree, const void *key,
+        void *(*make_object)(const void *key))
+{
+    struct sync *s = sync_(tree);
+    void *object;
+    pthread_rwlock_wrlock(&s->lock);
+    object = bstree_find_or_insert(s->tree, key, make_object);
+    pthread_rwlock_unlock(&s->lock);
+    return object;
+}
+
+static void sync_remove_(struct bstree *tree, const void *key)
+{
+    struct sync *s = sync_(tree);
+    pthread_rwlock_wrlock(&s->lock);
+    bstree_remove(s->tree, key);
+    pthread_rwlock_unlock(&s->lock);
+}
+
+static void *sync_search_(const struct bstree *tree, const void *key)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    void *object;
+    read_lock_(s, &h);
+    object = bstree_search(s->tree, key);
+    read_unlock_(&h);
+    return object;
+}
+
+static int sync_count_(const struct bstree *tree, const void *key)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    int count;
+    read_lock_(s, &h);
+    count = bstree_count(s->tree, key);
+    read_unlock_(&h);
+    return count;
+}
+
+static int sync_traverse_(const struct bstree *tree, void *it_data,
+        int (*operation)(void *object, void *it_data), int cnt)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    int ret;
+    read_lock_(s, &h);
+    ret = cnt ? bstree_traverse_inorder_cnt(s->tree, it_data, operation) :
+        bstree_traverse_inorder(s->tree, it_data, operation);
+    read_unlock_(&h);
+    return ret;
+}
+
+static int sync_size_(const struct bstree *tree)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    int size;
+    read_lock_(s, &h);
+    size = bstree_size(s->tree);
+    read_unlock_(&h);
+    return size;
+}
+
+static long sync_size_cnt_(const struct bstree *tree)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    long size_cnt;
+    read_lock_(s, &h);
+    size_cnt = bstree_size_cnt(s->tree);
+    read_unlock_(&h);
+    return size_cnt;
+}
+
+static int sync_height_(const struct bstree *tree)
+{
+    struct sync *s = sync_(tree);
+    struct held h;
+    int height;
+    read_lock_(s, &h);
+    height = bstree_height(s->tree);
+    read_unlock_(&h);
+    return height;
+}
+
+static void sync_destroy_(struct bstree *tree)
+{
+    struct sync *s = sync_(tree);
+    bstree_destroy(s->tree);
+    pthread_rwlock_destroy(&s->lock);
+    free(s);
+}
+
+static const struct bstree_backend sync_backend = {
+    sync_insert_,
+    sync_replace_,
+    sync_remove_,
+    sync_search_,
+    sync_count_,
+    sync_traverse_,
+    sync_size_,
+    sync_size_cnt_,
+    sync_height_,
+    sync_destroy_,
+    NULL,
+    sync_find_or_insert_
+};
+
+struct bstree *bstree_new_sync(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object))
+{
+    struct bstree *tree = bstree_new(compare_object, NULL);
+    struct sync *s = malloc(sizeof *s);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    /* The default of glibc lets a steady stream of readers starve the
+     * writers. The preference is an enumerator, not a macro to test for, and
+     * recursive read locks are taken care of by read_lock_.
+     */
+    pthread_rwlockattr_setkind_np(&attr,
+            PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&s->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    s->tree = bstree_new_pooled(compare_object, free_object);
+    tree->ops->backend = &sync_backend;
+    tree->ops->impl = s;
+    return tree;
+}
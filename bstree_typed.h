@@ -0,0 +1,273 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BSTREE_TYPED_H
+#define BSTREE_TYPED_H
+
+/* Type specialized trees:
+ * BSTREE_DEFINE(name, key_type, cmp) defines a struct name holding keys of
+ * type key_type by value, and static inline functions name_init, name_insert,
+ * name_search, name_count, name_remove, name_traverse_inorder, name_destroy,
+ * name_size and name_height working on it, which behave like their bstree_
+ * counterparts. cmp(a, b) is called with two keys and has to return an int
+ * less than, equal to or greater than zero, like compare_object does. As it
+ * is expanded right in the functions, it can be a macro, and the compiler is
+ * free to inline it, which it can never do through the function pointer of a
+ * struct bstree:
+ *
+ *     #define CMP_INT(a, b) (((a) > (b)) - ((a) < (b)))
+ *     BSTREE_DEFINE(int_tree, int, CMP_INT)
+ *
+ *     struct int_tree tree;
+ *     int_tree_init(&tree);
+ *     int_tree_insert(&tree, 42);
+ *
+ * The tree owns copies of the keys, so there is no object to free. A struct
+ * name is empty after name_destroy, and can be used again.
+ */
+
+#include "bstree.h"
+
+#include <stdlib.h>
+
+#define BSTREE_DEFINE(name, key_type, cmp)                                     \
+                                                                               \
+struct name##_node {                                                           \
+    struct name##_node *left;                                                  \
+    struct name##_node *right;                                                 \
+    key_type key;                                                              \
+    int count;                                                                 \
+    int height;                                                                \
+};                                                                             \
+                                                                               \
+struct name {                                                                  \
+    struct name##_node *root;                                                  \
+    int size;                                                                  \
+};                                                                             \
+                                                                               \
+static inline int name##_height_(const struct name##_node *root)               \
+{                                                                              \
+    return root ? root->height : -1;                                           \
+}                                                                              \
+                                                                               \
+static inline void name##_update_(struct name##_node *root)                    \
+{                                                                              \
+    int left = name##_height_(root->left);                                     \
+    int right = name##_height_(root->right);                                   \
+    root->height = (left > right ? left : right) + 1;                          \
+}                                                                              \
+                                                                               \
+static inline struct name##_node *name##_rotate_with_left_(                    \
+        struct name##_node *root)                                              \
+{                                                                              \
+    struct name##_node *newroot = root->left;                                  \
+    root->left = newroot->right;                                               \
+    newroot->right = root;                                                     \
+    name##_update_(root);                                                      \
+    name##_update_(newroot);                                                   \
+    return newroot;                                                            \
+}                                                                              \
+                                                                               \
+static inline struct name##_node *name##_rotate_with_right_(                   \
+        struct name##_node *root)                                              \
+{                                                                              \
+    struct name##_node *newroot = root->right;                                 \
+    root->right = newroot->left;                                               \
+    newroot->left = root;                                                      \
+    name##_update_(root);                                                      \
+    name##_update_(newroot);                                                   \
+    return newroot;                                                            \
+}                                                                              \
+                                                                               \
+static inline struct name##_node *name##_balance_(struct name##_node *root)    \
+{                                                                              \
+    struct name##_node *left = root->left, *right = root->right;               \
+    if (name##_height_(left) - name##_height_(right) > 1) {                    \
+        if (name##_height_(left->left) < name##_height_(left->right)) {        \
+            root->left = name##_rotate_with_right_(left);                      \
+        }                                                                      \
+        return name##_rotate_with_left_(root);                                 \
+    }                                                                          \
+    if (name##_height_(right) - name##_height_(left) > 1) {                    \
+        if (name##_height_(right->right) < name##_height_(right->left)) {      \
+            root->right = name##_rotate_with_left_(right);                     \
+        }                                                                      \
+        return name##_rotate_with_right_(root);                                \
+    }                                                                          \
+    name##_update_(root);                                                      \
+    return root;                                                               \
+}                                                                              \
+                                                                               \
+static inline void name##_rebalance_path_(struct name##_node **path[],         \
+        int depth)                                                             \
+{                                                                              \
+    while (depth-- > 0) {                                                      \
+        struct name##_node **link = path[depth];                               \
+        int height = (*link)->height;                                          \
+        *link = name##_balance_(*link);                                        \
+        if ((*link)->height == height) {                                       \
+            return;                                                            \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline struct name##_node **name##_find_link_(struct name *tree,        \
+        key_type key, struct name##_node **path[], int *depth)                 \
+{                                                                              \
+    struct name##_node **link = &tree->root;                                   \
+    *depth = 0;                                                                \
+    while (*link) {                                                            \
+        int c = cmp(key, (*link)->key);                                        \
+        if (c == 0) {                                                          \
+            break;                                                             \
+        }                                                                      \
+        path[(*depth)++] = link;                                               \
+        link = c < 0 ? &(*link)->left : &(*link)->right;                       \
+    }                                                                          \
+    return link;                                                               \
+}                                                                              \
+                                                                               \
+static inline void name##_init(struct name *tree)                              \
+{                                                                              \
+    tree->root = NULL;                                                         \
+    tree->size = 0;                                                            \
+}                                                                              \
+                                                                               \
+static inline void name##_insert(struct name *tree, key_type key)              \
+{                                                                              \
+    struct name##_node **path[BSTREE_MAX_HEIGHT];                              \
+    int depth;                                                                 \
+    struct name##_node **link = name##_find_link_(tree, key, path, &depth);    \
+    if (*link) {                                                               \
+        (*link)->count++;                                                      \
+        return;                                                                \
+    }                                                                          \
+    *link = malloc(sizeof **link);                                             \
+    (*link)->left = NULL;                                                      \
+    (*link)->right = NULL;                                                     \
+    (*link)->key = key;                                                        \
+    (*link)->count = 1;                                                        \
+    (*link)->height = 0;                                                       \
+    tree->size++;                                                              \
+    name##_rebalance_path_(path, depth);                                       \
+}                                                                              \
+                                                                               \
+static inline struct name##_node *name##_find_(const struct name *tree,        \
+        key_type key)                                                          \
+{                                                                              \
+    struct name##_node *root = tree->root;                                     \
+    while (root) {                                                             \
+        int c = cmp(key, root->key);                                           \
+        if (c == 0) {                                                          \
+            break;                                                             \
+        }                                                                      \
+        root = c < 0 ? root->left : root->right;                               \
+    }                                                                          \
+    return root;                                                               \
+}                                                                              \
+                                                                               \
+static inline key_type *name##_search(const struct name *tree, key_type key)   \
+{                                                                              \
+    struct name##_node *node = name##_find_(tree, key);                        \
+    return node ? &node->key : NULL;                                           \
+}                                                                              \
+                                                                               \
+static inline int name##_count(const struct name *tree, key_type key)          \
+{                                                                              \
+    struct name##_node *node = name##_find_(tree, key);                        \
+    return node ? node->count : 0;                                             \
+}                                                                              \
+                                                                               \
+static inline void name##_remove(struct name *tree, key_type key)              \
+{                                                                              \
+    struct name##_node **path[BSTREE_MAX_HEIGHT];                              \
+    int depth;                                                                 \
+    struct name##_node **link = name##_find_link_(tree, key, path, &depth);    \
+    struct name##_node *node = *link;                                          \
+    if (!node) {                                                               \
+        return;                                                                \
+    }                                                                          \
+    if (!node->left || !node->right) {                                         \
+        *link = node->left ? node->left : node->right;                         \
+    } else {                                                                   \
+        struct name##_node **min_link = &node->right;                          \
+        struct name##_node *min;                                               \
+        int top = depth;                                                       \
+        path[depth++] = link;                                                  \
+        while ((*min_link)->left) {                                            \
+            path[depth++] = min_link;                                          \
+            min_link = &(*min_link)->left;                                     \
+        }                                                                      \
+        min = *min_link;                                                       \
+        *min_link = min->right;                                                \
+        min->left = node->left;                                                \
+        min->right = node->right;                                              \
+        min->height = node->height;                                            \
+        *link = min;                                                           \
+        if (depth > top + 1) {                                                 \
+            path[top + 1] = &min->right;                                       \
+        }                                                                      \
+    }                                                                          \
+    free(node);                                                                \
+    tree->size--;                                                              \
+    name##_rebalance_path_(path, depth);                                       \
+}                                                                              \
+                                                                               \
+static inline int name##_traverse_inorder_(struct name##_node *root,           \
+        void *it_data, int (*operation)(key_type *key, void *it_data))         \
+{                                                                              \
+    return                                                                     \
+        root &&                                                                \
+        (name##_traverse_inorder_(root->left, it_data, operation) ||           \
+        operation(&root->key, it_data) ||                                      \
+        name##_traverse_inorder_(root->right, it_data, operation));            \
+}                                                                              \
+                                                                               \
+static inline int name##_traverse_inorder(const struct name *tree,             \
+        void *it_data, int (*operation)(key_type *key, void *it_data))         \
+{                                                                              \
+    return name##_traverse_inorder_(tree->root, it_data, operation);           \
+}                                                                              \
+                                                                               \
+static inline void name##_destroy_(struct name##_node *root)                   \
+{                                                                              \
+    if (root) {                                                                \
+        name##_destroy_(root->left);                                           \
+        name##_destroy_(root->right);                                          \
+        free(root);                                                            \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static inline void name##_destroy(struct name *tree)                           \
+{                                                                              \
+    name##_destroy_(tree->root);                                               \
+    tree->root = NULL;                                                         \
+    tree->size = 0;                                                            \
+}                                                                              \
+                                                                               \
+static inline int name##_size(const struct name *tree)                         \
+{                                                                              \
+    return tree->size;                                                         \
+}                                                                              \
+                                                                               \
+static inline int name##_height(const struct name *tree)                       \
+{                                                                              \
+    return name##_height_(tree->root);                                         \
+}
+
+#endif
@@ -0,0 +1,349 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "bstree.h"
+#include "bstree_typed.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_N 1000000
+
+static long compare_calls;
+
+static int cmp_int(const void *lhs, const void *rhs)
+{
+    int a = *(const int *)lhs, b = *(const int *)rhs;
+    compare_calls++;
+    return (a > b) - (a < b);
+}
+
+static int cmp_str(const void *lhs, const void *rhs)
+{
+    compare_calls++;
+    return strcmp(*(char * const *)lhs, *(char * const *)rhs);
+}
+
+/* The same comparison as cmp_int, expanded inline by BSTREE_DEFINE */
+#define CMP_INT(a, b) (compare_calls++, ((a) > (b)) - ((a) < (b)))
+
+BSTREE_DEFINE(int_tree, int, CMP_INT)
+
+static uint64_t int_prefix(const void *p)
+{
+    /* Flip the sign bit so that negative numbers come first */
+    return (uint32_t)*(const int *)p ^ 0x80000000u;
+}
+
+static uint64_t str_prefix(const void *p)
+{
+    return bstree_str_prefix(*(char * const *)p);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, const char *op, int n, double start)
+{
+    printf("%-8s %-8s %10.2f compares/op %10.1f ns/op\n", name, op,
+            (double)compare_calls / n, (now() - start) * 1e9 / n);
+    compare_calls = 0;
+}
+
+/* Insert, look up one by one, in batches and in a frozen copy, and remove the
+ * n keys given in keys, each being elem_size bytes, reporting the comparator
+ * calls and time spent per operation. The tree is destroyed afterwards.
+ */
+static void run(const char *name, struct bstree *tree, char *keys,
+        size_t elem_size, int n)
+{
+    const void **batch = malloc(n * sizeof *batch);
+    void **found = malloc(n * sizeof *found);
+    struct bstree *frozen;
+    double start;
+    int i;
+    for (i = 0; i < n; i++) {
+        batch[i] = keys + i * elem_size;
+    }
+    compare_calls = 0;
+    start = now();
+    for (i = 0; i < n; i++) {
+        bstree_insert(tree, keys + i * elem_size);
+    }
+    report(name, "insert", n, start);
+    start = now();
+    for (i = 0; i < n; i++) {
+        bstree_search(tree, keys + i * elem_size);
+    }
+    report(name, "search", n, start);
+    start = now();
+    bstree_search_batch(tree, batch, n, found);
+    report(name, "batch", n, start);
+    frozen = bstree_freeze(tree);
+    compare_calls = 0;
+    start = now();
+    for (i = 0; i < n; i++) {
+        bstree_search(frozen, keys + i * elem_size);
+    }
+    report(name, "frozen", n, start);
+    bstree_destroy(frozen);
+    start = now();
+    for (i = 0; i < n; i++) {
+        bstree_remove(tree, keys + i * elem_size);
+    }
+    report(name, "remove", n, start);
+    bstree_destroy(tree);
+    free(found);
+    free(batch);
+}
+
+/* Same as run, for the int_tree specialized by BSTREE_DEFINE */
+static void run_typed(const char *name, const int *keys, int n)
+{
+    struct int_tree tree;
+    double start;
+    int i;
+    int_tree_init(&tree);
+    compare_calls = 0;
+    start = now();
+    for (i = 0; i < n; i++) {
+        int_tree_insert(&tree, keys[i]);
+    }
+    report(name, "insert", n, start);
+    start = now();
+    for (i = 0; i < n; i++) {
+        int_tree_search(&tree, keys[i]);
+    }
+    report(name, "search", n, start);
+    start = now();
+    for (i = 0; i < n; i++) {
+        int_tree_remove(&tree, keys[i]);
+    }
+    report(name, "remove", n, start);
+    int_tree_destroy(&tree);
+}
+
+static int insert_into(void *object, void *it_data)
+{
+    bstree_insert(it_data, object);
+    return 0;
+}
+
+/* Merge a tree of n / 100 keys into one of n keys, once by inserting the
+ * objects one by one and once with bstree_union, reporting per merged key.
+ */
+static void run_union(const int *keys, int n)
+{
+    struct bstree *big = bstree_new(cmp_int, NULL);
+    struct bstree *small = bstree_new(cmp_int, NULL);
+    int m = n / 100 + 1, i;
+    double start;
+    for (i = 0; i < n; i++) {
+        bstree_insert(big, (void *)&keys[i]);
+    }
+    for (i = 0; i < m; i++) {
+        bstree_insert(small, (void *)&keys[i * 97 % n]);
+    }
+    compare_calls = 0;
+    start = now();
+    bstree_traverse_inorder_cnt(small, big, insert_into);
+    report("merge", "insert", m, start);
+    start = now();
+    bstree_union(big, small);
+    report("merge", "union", m, start);
+    bstree_destroy(small);
+    bstree_destroy(big);
+}
+
+static int cmp_int_ptr(const void *lhs, const void *rhs)
+{
+    return cmp_int(*(const int *const *)lhs, *(const int *const *)rhs);
+}
+
+/* Remove a tenth of the keys from a tree of n keys, once one by one and once
+ * with bstree_remove_batch, reporting per removed key.
+ */
+static void run_expire(const int *keys, int n)
+{
+    int m = n / 10 + 1, pass, i;
+    const void **batch = malloc(m * sizeof *batch);
+    double start;
+    for (i = 0; i < m; i++) {
+        batch[i] = &keys[i * 7 % n];
+    }
+    qsort(batch, m, sizeof *batch, cmp_int_ptr);
+    for (pass = 0; pass < 2; pass++) {
+        struct bstree *tree = bstree_new(cmp_int, NULL);
+        for (i = 0; i < n; i++) {
+            bstree_insert(tree, (void *)&keys[i]);
+        }
+        compare_calls = 0;
+        start = now();
+        if (pass) {
+            bstree_remove_batch(tree, batch, m);
+        } else {
+            for (i = 0; i < m; i++) {
+                bstree_remove(tree, batch[i]);
+            }
+        }
+        report("expire", pass ? "batch" : "remove", m, start);
+        bstree_destroy(tree);
+    }
+    free(batch);
+}
+
+static uint64_t hash_int(const void *p)
+{
+    return (uint32_t)*(const int *)p * 0x9e3779b97f4a7c15u;
+}
+
+/* Look up n keys drawn mostly from a small set of hot ones, without and with
+ * a cache in front of the tree.
+ */
+static void run_cache(const int *keys, int n)
+{
+    struct bstree *tree = bstree_new(cmp_int, NULL);
+    int hot = n < 1000 ? n : 1000, pass, i;
+    long hits, misses;
+    double start;
+    for (i = 0; i < n; i++) {
+        bstree_insert(tree, (void *)&keys[i]);
+    }
+    for (pass = 0; pass < 2; pass++) {
+        srand(7);
+        compare_calls = 0;
+        start = now();
+        for (i = 0; i < n; i++) {
+            int k = rand() % 100 ? rand() % hot : rand() % n;
+            bstree_search(tree, &keys[k]);
+        }
+        report("hot", pass ? "cached" : "search", n, start);
+        if (!pass) {
+            bstree_set_cache(tree, 4 * hot, hash_int);
+        }
+    }
+    bstree_cache_stats(tree, &hits, &misses);
+    printf("hot      cache    %10.2f hit rate\n", (double)hits / n);
+    bstree_destroy(tree);
+}
+
+/* Build a tree owning n sorted keys and destroy it, with the given number of
+ * threads.
+ */
+static void run_build(int threads, int n)
+{
+    struct bstree *tree = bstree_new(cmp_int, free);
+    void **objects = malloc(n * sizeof *objects);
+    char name[16];
+    double start;
+    int i;
+    for (i = 0; i < n; i++) {
+        objects[i] = malloc(sizeof(int));
+        *(int *)objects[i] = i;
+    }
+    snprintf(name, sizeof name, "%dthr", threads);
+    bstree_set_threads(tree, threads);
+    start = now();
+    bstree_build_sorted(tree, objects, n);
+    report(name, "build", n, start);
+    start = now();
+    bstree_destroy(tree);
+    report(name, "destroy", n, start);
+    free(objects);
+}
+
+static size_t encode_int(const void *object, void *buf)
+{
+    if (buf) {
+        memcpy(buf, object, sizeof(int));
+    }
+    return sizeof(int);
+}
+
+/* Save a tree of the n keys, map it back and look the keys up in it.
+ */
+static void run_file(const int *keys, int n)
+{
+    const char *path = "/tmp/bstree_bench.bst";
+    struct bstree *tree = bstree_new(cmp_int, NULL);
+    double start;
+    int i;
+    for (i = 0; i < n; i++) {
+        bstree_insert(tree, (void *)&keys[i]);
+    }
+    compare_calls = 0;
+    start = now();
+    bstree_save(tree, path, encode_int);
+    report("file", "save", n, start);
+    bstree_destroy(tree);
+    start = now();
+    tree = bstree_mmap_load(path, cmp_int);
+    report("file", "load", n, start);
+    start = now();
+    for (i = 0; i < n; i++) {
+        bstree_search(tree, &keys[i]);
+    }
+    report("file", "search", n, start);
+    bstree_destroy(tree);
+    remove(path);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : DEFAULT_N;
+    int *ints = malloc(n * sizeof *ints);
+    char **strs = malloc(n * sizeof *strs);
+    int i;
+    srand(42);
+    for (i = 0; i < n; i++) {
+        ints[i] = rand();
+        strs[i] = malloc(16);
+        snprintf(strs[i], 16, "%d", ints[i]);
+    }
+    run("int", bstree_new(cmp_int, NULL), (char *)ints, sizeof *ints, n);
+    run_typed("int/type", ints, n);
+    run("string", bstree_new(cmp_str, NULL), (char *)strs, sizeof *strs, n);
+    run("compact", bstree_new_compact(cmp_int, NULL), (char *)ints,
+            sizeof *ints, n);
+    run("btree", bstree_new_btree(cmp_int, NULL), (char *)ints, sizeof *ints,
+            n);
+    run("int/key", bstree_new_keyed(cmp_int, NULL, int_prefix), (char *)ints,
+            sizeof *ints, n);
+    run("str/key", bstree_new_keyed(cmp_str, NULL, str_prefix), (char *)strs,
+            sizeof *strs, n);
+    run_union(ints, n);
+    run_expire(ints, n);
+    run_cache(ints, n);
+    run_file(ints, n);
+    run_build(1, n);
+    run_build(sysconf(_SC_NPROCESSORS_ONLN), n);
+    for (i = 0; i < n; i++) {
+        free(strs[i]);
+    }
+    free(strs);
+    free(ints);
+    return 0;
+}
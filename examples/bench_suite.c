@@ -0,0 +1,332 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark suite, run by make bench. For every size given on the command
+ * line (or the default ones), key distribution, comparator and node
+ * allocation, it times insertion, search, traversal and removal of n keys
+ * and prints one CSV line per operation: the throughput, latency percentiles
+ * over a sample of the operations, the comparator calls per operation and
+ * the height of the tree. The calls and heights are the same from one run to
+ * the next, so any change there points to balance_ or the descents.
+ */
+
+#include "bstree.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* At most this many latencies are kept per operation, evenly spread */
+#define MAX_SAMPLES (1 << 20)
+
+#define ZIPF_THETA 0.99
+
+static const long default_sizes[] = { 1000, 10000, 100000, 1000000 };
+
+static long compare_calls;
+
+static int cmp_int(const void *lhs, const void *rhs)
+{
+    uint32_t a = *(const uint32_t *)lhs, b = *(const uint32_t *)rhs;
+    compare_calls++;
+    return (a > b) - (a < b);
+}
+
+static int cmp_str(const void *lhs, const void *rhs)
+{
+    compare_calls++;
+    return strcmp(lhs, rhs);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, so that the keys do not depend on the rand of the platform */
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double next_uniform(void)
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Scatter the ranks over the 32 bit keys, the same way for every size, so
+ * that no two ranks below 2^32 get the same key.
+ */
+static uint32_t scatter(uint64_t rank)
+{
+    return (uint32_t)(rank * 2654435761u);
+}
+
+/* Zipfian ranks in [0, n), rank 0 being the most frequent, as in Gray et
+ * al., "Quickly generating billion-record synthetic databases".
+ */
+struct zipf {
+    long n;
+    double zetan, alpha, eta, half_pow;
+};
+
+static void zipf_init(struct zipf *z, long n)
+{
+    double zeta2 = 1 + pow(0.5, ZIPF_THETA);
+    long i;
+    z->n = n;
+    z->zetan = 0;
+    for (i = 1; i <= n; i++) {
+        z->zetan += pow(i, -ZIPF_THETA);
+    }
+    z->alpha = 1 / (1 - ZIPF_THETA);
+    z->eta = (1 - pow(2.0 / n, 1 - ZIPF_THETA)) / (1 - zeta2 / z->zetan);
+    z->half_pow = 1 + pow(0.5, ZIPF_THETA);
+}
+
+static long zipf_next(const struct zipf *z)
+{
+    double u = next_uniform(), uz = u * z->zetan;
+    long rank;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < z->half_pow) {
+        return 1;
+    }
+    rank = (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+enum dist { RANDOM, SORTED, ZIPFIAN };
+
+static const char *dist_names[] = { "random", "sorted", "zipfian" };
+
+/* Fill keys with the n keys to insert, in the order they are inserted:
+ * distinct ones in random or increasing order, or draws from a zipfian
+ * distribution over n distinct ones, for which most insertions only
+ * increment a count.
+ */
+static void make_keys(uint32_t *keys, long n, enum dist dist)
+{
+    struct zipf z;
+    long i;
+    switch (dist) {
+    case RANDOM:
+        for (i = 0; i < n; i++) {
+            keys[i] = scatter(i);
+        }
+        for (i = n - 1; i > 0; i--) {
+            long j = next_random() % (i + 1);
+            uint32_t tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+        break;
+    case SORTED:
+        for (i = 0; i < n; i++) {
+            keys[i] = (uint32_t)i * 2;
+        }
+        break;
+    case ZIPFIAN:
+        zipf_init(&z, n);
+        for (i = 0; i < n; i++) {
+            keys[i] = scatter(zipf_next(&z));
+        }
+        break;
+    }
+}
+
+/* The latencies of one operation, taken for every stride-th call */
+struct samples {
+    double *ns;
+    long n;
+    long stride;
+};
+
+static int cmp_double(const void *lhs, const void *rhs)
+{
+    double a = *(const double *)lhs, b = *(const double *)rhs;
+    return (a > b) - (a < b);
+}
+
+/* Print the p-th fraction of the sorted latencies, or nothing if there are
+ * none, as for traversals, which are timed as a whole.
+ */
+static void print_percentile(const struct samples *s, double p)
+{
+    if (s->n) {
+        printf(",%.0f", s->ns[(long)(p * (s->n - 1) + 0.5)]);
+    } else {
+        printf(",");
+    }
+}
+
+static void print_header(void)
+{
+    printf("size,dist,cmp,tree,op,ops,mops,p50_ns,p90_ns,p99_ns,p999_ns,"
+            "max_ns,compares_per_op,height\n");
+}
+
+/* The height is that of the tree after the operation */
+static void report(const char *prefix, const char *op, long ops,
+        double seconds, struct samples *s, struct bstree *tree)
+{
+    qsort(s->ns, s->n, sizeof *s->ns, cmp_double);
+    printf("%s,%s,%ld,%.3f", prefix, op, ops, ops / seconds / 1e6);
+    print_percentile(s, 0.5);
+    print_percentile(s, 0.9);
+    print_percentile(s, 0.99);
+    print_percentile(s, 0.999);
+    print_percentile(s, 1);
+    printf(",%.2f,%d\n", (double)compare_calls / ops, bstree_height(tree));
+    fflush(stdout);
+    compare_calls = 0;
+    s->n = 0;
+}
+
+/* Time op(tree, objects[i]) for every i, sampling the latencies */
+static double run_op(struct bstree *tree, void **objects, long n,
+        struct samples *s, void (*op)(struct bstree *tree, void *object))
+{
+    double start = now();
+    long i;
+    for (i = 0; i < n; i++) {
+        if (i % s->stride == 0) {
+            double t = now();
+            op(tree, objects[i]);
+            s->ns[s->n++] = (now() - t) * 1e9;
+        } else {
+            op(tree, objects[i]);
+        }
+    }
+    return now() - start;
+}
+
+static void insert_op(struct bstree *tree, void *object)
+{
+    bstree_insert(tree, object);
+}
+
+static void search_op(struct bstree *tree, void *object)
+{
+    bstree_search(tree, object);
+}
+
+static void remove_op(struct bstree *tree, void *object)
+{
+    bstree_remove(tree, object);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static int visit(void *object, void *it_data)
+{
+    ++*(long *)it_data;
+    return 0;
+}
+
+#pragma GCC diagnostic pop
+
+/* Insert, search for, traverse and remove the objects in the given tree,
+ * which is destroyed afterwards.
+ */
+static void run(const char *prefix, struct bstree *tree, void **objects,
+        long n, struct samples *s)
+{
+    double seconds;
+    long visited = 0;
+    compare_calls = 0;
+    seconds = run_op(tree, objects, n, s, insert_op);
+    report(prefix, "insert", n, seconds, s, tree);
+    seconds = run_op(tree, objects, n, s, search_op);
+    report(prefix, "search", n, seconds, s, tree);
+    seconds = now();
+    bstree_traverse_inorder_cnt(tree, &visited, visit);
+    seconds = now() - seconds;
+    report(prefix, "traverse", visited, seconds, s, tree);
+    seconds = run_op(tree, objects, n, s, remove_op);
+    report(prefix, "remove", n, seconds, s, tree);
+    bstree_destroy(tree);
+}
+
+static void run_size(long n)
+{
+    uint32_t *keys = malloc(n * sizeof *keys);
+    char *strs = malloc(n * 11);
+    void **objects = malloc(n * sizeof *objects);
+    struct samples s;
+    char prefix[64];
+    int dist, str, pooled;
+    long i;
+    s.stride = n / MAX_SAMPLES + 1;
+    s.ns = malloc((n / s.stride + 1) * sizeof *s.ns);
+    s.n = 0;
+    for (dist = RANDOM; dist <= ZIPFIAN; dist++) {
+        make_keys(keys, n, dist);
+        for (i = 0; i < n; i++) {
+            snprintf(strs + i * 11, 11, "%010u", keys[i]);
+        }
+        for (str = 0; str < 2; str++) {
+            for (i = 0; i < n; i++) {
+                objects[i] = str ? (void *)(strs + i * 11) : &keys[i];
+            }
+            for (pooled = 0; pooled < 2; pooled++) {
+                int (*compare)(const void *, const void *) =
+                    str ? cmp_str : cmp_int;
+                snprintf(prefix, sizeof prefix, "%ld,%s,%s,%s", n,
+                        dist_names[dist], str ? "string" : "int",
+                        pooled ? "pooled" : "malloc");
+                run(prefix, pooled ? bstree_new_pooled(compare, NULL) :
+                        bstree_new(compare, NULL), objects, n, &s);
+            }
+        }
+    }
+    free(s.ns);
+    free(objects);
+    free(strs);
+    free(keys);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    print_header();
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            run_size(atol(argv[i]));
+        }
+    } else {
+        for (i = 0; i < (int)(sizeof default_sizes / sizeof *default_sizes);
+                i++) {
+            run_size(default_sizes[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+    Generic AVL tree implementation in C
+    Copyright (C) 2017 Yagmur Oymak
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Throughput of a tree shared between threads, with a read-heavy workload:
+ * out of every 100 operations 99 are searches and one inserts or removes a
+ * key. The shared trees are a default tree behind a single mutex, a tree
+ * made with bstree_new_sync, and one made with bstree_new_rcu. Then the keys
+ * of a default tree are summed up with bstree_parallel_for_each.
+ */
+
+#include "bstree.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_N 1000000
+#define OPS_PER_THREAD 1000000
+#define MAX_THREADS 8
+
+static int *keys;
+static int nkeys;
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker {
+    pthread_t thread;
+    struct bstree *tree;
+    int locked;
+    unsigned seed;
+};
+
+static int cmp_int(const void *lhs, const void *rhs)
+{
+    int a = *(const int *)lhs, b = *(const int *)rhs;
+    return (a > b) - (a < b);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    int i;
+    for (i = 0; i < OPS_PER_THREAD; i++) {
+        int r = rand_r(&w->seed);
+        int *key = &keys[r % nkeys];
+        if (w->locked) {
+            pthread_mutex_lock(&big_lock);
+        }
+        if (i % 100 != 99) {
+            bstree_search(w->tree, key);
+        } else if (r & 0x100) {
+            bstree_insert(w->tree, key);
+        } else {
+            bstree_remove(w->tree, key);
+        }
+        if (w->locked) {
+            pthread_mutex_unlock(&big_lock);
+        }
+    }
+    return NULL;
+}
+
+/* Run the workload on the given tree with 1, 2, 4, ... MAX_THREADS threads,
+ * taking the global mutex around every operation if locked is set.
+ */
+static void run(const char *name, struct bstree *tree, int locked)
+{
+    struct worker workers[MAX_THREADS];
+    int threads, i;
+    for (i = 0; i < nkeys; i++) {
+        bstree_insert(tree, &keys[i]);
+    }
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double start = now();
+        for (i = 0; i < threads; i++) {
+            workers[i].tree = tree;
+            workers[i].locked = locked;
+            workers[i].seed = i + 1;
+            pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+        }
+        for (i = 0; i < threads; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        printf("%-8s %d threads %10.2f Mops/s\n", name, threads,
+                (double)threads * OPS_PER_THREAD / (now() - start) / 1e6);
+    }
+    bstree_destroy(tree);
+}
+
+static int add_key(void *object, void *it_data)
+{
+    *(long *)it_data += *(int *)object;
+    return 0;
+}
+
+static void add_sum(void *acc, void *other)
+{
+    *(long *)acc += *(long *)other;
+}
+
+static void run_sum(void)
+{
+    struct bstree *tree = bstree_new(cmp_int, NULL);
+    long sums[MAX_THREADS];
+    void *accs[MAX_THREADS];
+    int threads, i;
+    for (i = 0; i < nkeys; i++) {
+        bstree_insert(tree, &keys[i]);
+    }
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double start = now();
+        for (i = 0; i < threads; i++) {
+            sums[i] = 0;
+            accs[i] = &sums[i];
+        }
+        bstree_parallel_for_each(tree, threads, accs, add_key, add_sum);
+        printf("%-8s %d threads %10.2f Mobjects/s (sum %ld)\n", "sum",
+                threads, bstree_size(tree) / (now() - start) / 1e6, sums[0]);
+    }
+    bstree_destroy(tree);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+    nkeys = argc > 1 ? atoi(argv[1]) : DEFAULT_N;
+    keys = malloc(nkeys * sizeof *keys);
+    srand(42);
+    for (i = 0; i < nkeys; i++) {
+        keys[i] = rand();
+    }
+    run("mutex", bstree_new(cmp_int, NULL), 1);
+    run("rwlock", bstree_new_sync(cmp_int, NULL), 0);
+    run("rcu", bstree_new_rcu(cmp_int, NULL), 0);
+    run_sum();
+    free(keys);
+    return 0;
+}
@@ -20,154 +20,183 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #define OUT_LEN 30
 
+/* Inputs not mapped are read this many bytes at a time */
+#define READ_SIZE (1 << 20)
+
+/* The words and their strings are carved out of blocks of this size */
+#define ARENA_BLOCK (1 << 20)
+
+/* Every thread building the table gets at least this much of the input */
+#define MIN_PART (1 << 20)
+
 struct cli_opts {
     char *initial_word;
     char *delimiter;
     int out_len;
     int print_stats;
     int wrap;
+    int threads;
+};
+
+/* Memory handed out in order from large blocks, and freed all at once */
+struct arena {
+    struct arena_block *blocks;
+    char *next;
+    size_t left;
+};
+
+struct arena_block {
+    struct arena_block *next;
+    char data[];
 };
 
 struct word {
     char *str;
+    /* The strings of the words following this one in the text, each counted
+     * as many times as it follows. They are those of the words in the table,
+     * or of their copies in the tables merged into it, all of which stay in
+     * the arenas until the end.
+     */
     struct bstree *nextwords;
-    double cnt;
-};
-
-struct random_choice {
-    struct word *word;
-    double rnd;
-    double sum;
 };
 
 static double uniform_rnd(void)
 {
-    return (double)rand() / (double)RAND_MAX;
+    return (double)rand() / ((double)RAND_MAX + 1);
 }
 
-static int choose_word(void *currp, void *choicep)
+static char *choose_next(struct word *curr)
 {
-    struct word *curr = currp;
-    struct random_choice *choice = choicep;
-    if (choice->sum < choice->rnd) {
-        choice->word = curr;
-        choice->sum += curr->cnt;
-        return 0;
-    } else {
-        return 1;
-    }
+    return bstree_sample_weighted(curr->nextwords, uniform_rnd());
 }
 
-static struct word *choose_next(struct word *curr)
+static int cmp_word(const void *lhs, const void *rhs)
 {
-    struct random_choice choice = { NULL, uniform_rnd(), 0 };
-    bstree_traverse_inorder(curr->nextwords, &choice, choose_word);
-    return choice.word;
+    return strcmp(((struct word *)lhs)->str, ((struct word *)rhs)->str);
 }
 
-static int cmp_word(const void *lhs, const void *rhs)
+static int cmp_str(const void *lhs, const void *rhs)
 {
-    return strcmp(((struct word *)lhs)->str, ((struct word *)rhs)->str);
+    return strcmp(lhs, rhs);
 }
 
-static void free_word(void *p)
+static uint64_t word_prefix(const void *p)
 {
-    struct word *word = p;
-    bstree_destroy(word->nextwords);
-    free(word->str);
-    free(word);
+    return bstree_str_prefix(((const struct word *)p)->str);
 }
 
-static struct word *mkword(char *str)
+static uint64_t str_prefix(const void *p)
 {
-    struct word *w = malloc(sizeof *w);
-    w->str = strdup(str);
-    w->nextwords = bstree_new(cmp_word, free_word);
-    w->cnt = 1;
-    return w;
+    return bstree_str_prefix(p);
 }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+    void *p;
+    size = (size + 7) & ~(size_t)7;
+    if (size > arena->left) {
+        size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *block = malloc(sizeof *block + block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->next = block->data;
+        arena->left = block_size;
+    }
+    p = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    return p;
+}
 
-static int print_word(void *p, void *it_data)
+static void arena_free(struct arena *arena)
 {
-    struct word *w = p;
-    printf("    %s : %.2f\n", w->str, w->cnt);
-    return 0;
+    struct arena_block *block, *next;
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
 }
 
-static int print_tree(void *p, void *it_data)
+/* The key to look a word up with, along with where to make it if missing.
+ * The word comes first, so that the key can be compared as a word.
+ */
+struct word_key {
+    struct word word;
+    struct arena *arena;
+};
+
+static void *make_word(const void *key)
 {
-    struct word *word = p;
-    printf("%s\n", word->str);
-    bstree_traverse_inorder(word->nextwords, NULL, print_word);
+    const struct word_key *k = key;
+    struct word *w = arena_alloc(k->arena, sizeof *w);
+    size_t len = strlen(k->word.str) + 1;
+    w->str = memcpy(arena_alloc(k->arena, len), k->word.str, len);
+    w->nextwords = bstree_new_keyed(cmp_str, NULL, str_prefix);
+    return w;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+/* The words themselves live in the arenas */
+static int free_word(void *p, void *it_data)
+{
+    bstree_destroy(((struct word *)p)->nextwords);
     return 0;
 }
 
 #pragma GCC diagnostic pop
 
-static int normalize_counts(void *p, void *it_data)
+static int print_word(void *p, void *it_data)
 {
-    struct word *word = p;
-    word->cnt /= *(double *)it_data;
+    struct bstree *nextwords = it_data;
+    printf("    %s : %.2f\n", (char *)p, (double)bstree_count(nextwords, p)
+            / bstree_size_cnt(nextwords));
     return 0;
 }
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
-static int normalize_transitions(void *p, void *it_data)
+static int print_tree(void *p, void *it_data)
 {
-    struct word *word;
-    double sum;
-    word = p;
-    sum = word->cnt;
-    bstree_traverse_inorder(word->nextwords, &sum, normalize_counts);
+    struct word *word = p;
+    printf("%s\n", word->str);
+    bstree_traverse_inorder(word->nextwords, word->nextwords, print_word);
     return 0;
 }
 
 #pragma GCC diagnostic pop
 
-static void add_transition(struct bstree *table, char *curr, char *next)
+static void add_transition(struct word *curr, struct word *next)
 {
-    struct word key;
-    struct word *word, *nextword;
-    key.str = curr;
-    word = bstree_search(table, &key);
-    if (!word) {
-        word = mkword(curr);
-        bstree_insert(table, word);
-    } else {
-        word->cnt++;
-    }
-    key.str = next;
-    nextword = bstree_search(word->nextwords, &key);
-    if (!nextword) {
-        nextword = mkword(next);
-        bstree_insert(word->nextwords, nextword);
-    } else {
-        nextword->cnt++;
-    }
+    /* Inserting the same string again only increments its count */
+    bstree_insert(curr->nextwords, next->str);
 }
 
 static void print_usage(char **argv)
 {
     fprintf(stderr, "Usage: %s -i initial_word [-l out_len] [-t]"
-            " [-d delimiter] [-w]\n", argv[0]);
+            " [-d delimiter] [-w] [-j threads]\n", argv[0]);
     fprintf(stderr, "-l\t\tLength (in words) of the generated sequence\n");
     fprintf(stderr, "-i\t\tInitial word of the sequence\n");
     fprintf(stderr, "-t\t\tPrint the transition statistics\n");
     fprintf(stderr, "-d delimiter\tWord delimiter string, default is space\n");
     fprintf(stderr, "-w\t\tWrap output if longer than 80 characters\n");
+    fprintf(stderr, "-j threads\tThreads building the table, default is"
+            " one per processor\n");
 }
 
 /* Parse the command line options and place them in opts.
@@ -181,7 +210,12 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
     opts->print_stats = 0;
     opts->wrap = 0;
     opts->delimiter = " ";
-    while ((opt = getopt(argc, argv, "l:i:d:tw")) != -1) {
+    /* -1 if the number of processors is unknown */
+    opts->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->threads < 1) {
+        opts->threads = 1;
+    }
+    while ((opt = getopt(argc, argv, "l:i:d:twj:")) != -1) {
         switch (opt) {
             case 'l':
                 opts->out_len = strtol(optarg, NULL, 10);
@@ -207,6 +241,12 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
             case 'w':
                 opts->wrap = 1;
                 break;
+            case 'j':
+                opts->threads = strtol(optarg, NULL, 10);
+                if (opts->threads < 1) {
+                    return 1;
+                }
+                break;
             default:
                 return 1;
         }
@@ -215,45 +255,243 @@ static int parse_opts(int argc, char **argv, struct cli_opts *opts)
     return !opts->initial_word;
 }
 
-static struct bstree *generate_transition_table(struct cli_opts *opts)
+/* The whole input: mapped if it is a file, read in otherwise */
+struct input {
+    char *data;
+    size_t size;
+    int mapped;
+};
+
+static void read_input(struct input *in)
+{
+    struct stat st;
+    ssize_t len;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_size > 0) {
+        in->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                STDIN_FILENO, 0);
+        if (in->data != MAP_FAILED) {
+            in->size = st.st_size;
+            in->mapped = 1;
+            return;
+        }
+    }
+    in->data = NULL;
+    in->size = 0;
+    in->mapped = 0;
+    do {
+        in->data = realloc(in->data, in->size + READ_SIZE);
+        len = read(STDIN_FILENO, in->data + in->size, READ_SIZE);
+        in->size += len > 0 ? len : 0;
+    } while (len > 0 || (len < 0 && errno == EINTR));
+}
+
+static void free_input(struct input *in)
 {
-    char *line;
-    size_t bufsize;
-    ssize_t read_len;
-    char *curr, *next;
+    if (in->mapped) {
+        munmap(in->data, in->size);
+    } else {
+        free(in->data);
+    }
+}
+
+/* A part of the input, made into a table of its own by a thread. The words
+ * of the table, and their strings, are copied into the arena once each.
+ */
+struct part {
+    const char *begin;
+    const char *end;
+    /* The bytes words end at, the delimiters and the newline */
+    const char *is_delimiter;
     struct bstree *table;
-    table = bstree_new(cmp_word, free_word);
-    for (curr = NULL, line = NULL, bufsize = 0;
-            (read_len = getline(&line, &bufsize, stdin)) != EOF; ) {
-        if (line[read_len - 1] == '\n') {
-            line[read_len - 1] = '\0';
+    struct arena arena;
+    /* NUL terminated copy of the word being looked up */
+    char *buf;
+    size_t buf_size;
+    /* The first and last words of the part, NULL if it has none */
+    struct word *first;
+    struct word *last;
+    pthread_t thread;
+};
+
+static struct word *get_word(struct part *part, const char *str, size_t len)
+{
+    struct word_key key;
+    if (len + 1 > part->buf_size) {
+        part->buf_size = 2 * (len + 1);
+        part->buf = realloc(part->buf, part->buf_size);
+    }
+    memcpy(part->buf, str, len);
+    part->buf[len] = '\0';
+    key.word.str = part->buf;
+    key.arena = &part->arena;
+    return bstree_find_or_insert(part->table, &key, make_word);
+}
+
+static void *build_part(void *arg)
+{
+    struct part *part = arg;
+    const char *p = part->begin, *str;
+    struct word *word;
+    for (;;) {
+        while (p < part->end && part->is_delimiter[(unsigned char)*p]) {
+            p++;
         }
-        next = strtok(line, opts->delimiter);
-        while (next) {
-            if (curr) {
-                add_transition(table, curr, next);
-                free(curr);
-            }
-            curr = strdup(next);
-            next = strtok(NULL, opts->delimiter);
+        if (p == part->end) {
+            break;
+        }
+        for (str = p; p < part->end &&
+                !part->is_delimiter[(unsigned char)*p]; p++) {
         }
+        word = get_word(part, str, p - str);
+        if (part->last) {
+            add_transition(part->last, word);
+        } else {
+            part->first = word;
+        }
+        part->last = word;
     }
-    if (!curr) {
-        /* Empty input */
-        free(line);
-        return table;
+    free(part->buf);
+    return NULL;
+}
+
+/* Two tables being merged into the first one. The words of the second one
+ * come in order, so each is looked up starting where the last one was.
+ */
+struct merge {
+    struct bstree *table;
+    struct bstree *other;
+    struct bstree_hint hint;
+    pthread_t thread;
+};
+
+static int merge_word(void *p, void *it_data)
+{
+    struct merge *merge = it_data;
+    struct word *word = p;
+    struct word *found = bstree_hint_search(merge->table, &merge->hint, word);
+    if (found) {
+        bstree_union(found->nextwords, word->nextwords);
+        bstree_destroy(word->nextwords);
+    } else {
+        bstree_hint_insert(merge->table, &merge->hint, word);
     }
-    /* Add a transition from the last word to itself */
-    add_transition(table, curr, curr);
-    bstree_traverse_inorder(table, NULL, normalize_transitions);
-    free(curr);
-    free(line);
-    return table;
+    return 0;
+}
+
+static void *merge_tables(void *arg)
+{
+    struct merge *merge = arg;
+    bstree_hint_init(&merge->hint);
+    bstree_traverse_inorder(merge->other, merge, merge_word);
+    bstree_destroy(merge->other);
+    return NULL;
+}
+
+/* The table of the words of the input, each with the words following it */
+struct model {
+    struct bstree *table;
+    /* Where the words of the table are */
+    struct part *parts;
+    int n_parts;
+};
+
+/* Split the input into parts ending at word boundaries, build a table for
+ * each on a thread of its own, and merge the tables pairwise, on as many
+ * threads as there are pairs. The transitions across the ends of the parts
+ * are added last, along with the one from the last word to itself.
+ */
+static void generate_transition_table(struct model *model,
+        struct cli_opts *opts)
+{
+    char is_delimiter[256] = { 0 };
+    struct input in;
+    struct part *parts;
+    struct merge *merges;
+    struct word *prev = NULL, *first;
+    const char *d;
+    size_t size;
+    int n, i, step;
+    for (d = opts->delimiter; *d; d++) {
+        is_delimiter[(unsigned char)*d] = 1;
+    }
+    is_delimiter['\n'] = is_delimiter['\0'] = 1;
+    read_input(&in);
+    n = in.size / MIN_PART + 1;
+    n = n < opts->threads ? n : opts->threads;
+    parts = calloc(n, sizeof *parts);
+    merges = malloc(n * sizeof *merges);
+    for (i = 0; i < n; i++) {
+        parts[i].begin = i ? parts[i - 1].end : in.data;
+        size = in.size / n * (i + 1);
+        parts[i].end = i == n - 1 ? in.data + in.size : in.data + size;
+        while (parts[i].end < in.data + in.size &&
+                !is_delimiter[(unsigned char)*parts[i].end]) {
+            parts[i].end++;
+        }
+        parts[i].is_delimiter = is_delimiter;
+        parts[i].table = bstree_new_keyed(cmp_word, NULL, word_prefix);
+        pthread_create(&parts[i].thread, NULL, build_part, &parts[i]);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_join(parts[i].thread, NULL);
+    }
+    for (step = 1; step < n; step *= 2) {
+        for (i = 0; i + step < n; i += 2 * step) {
+            merges[i].table = parts[i].table;
+            merges[i].other = parts[i + step].table;
+            pthread_create(&merges[i].thread, NULL, merge_tables, &merges[i]);
+        }
+        for (i = 0; i + step < n; i += 2 * step) {
+            pthread_join(merges[i].thread, NULL);
+        }
+    }
+    model->table = parts[0].table;
+    for (i = 0; i < n; i++) {
+        if (!parts[i].first) {
+            continue;
+        }
+        /* The words of the parts may have been merged into others */
+        first = bstree_search(model->table, parts[i].first);
+        if (prev) {
+            add_transition(prev, first);
+        }
+        prev = bstree_search(model->table, parts[i].last);
+    }
+    if (prev) {
+        /* Add a transition from the last word to itself */
+        add_transition(prev, prev);
+    }
+    model->parts = parts;
+    model->n_parts = n;
+    free(merges);
+    free_input(&in);
+}
+
+static void destroy_model(struct model *model)
+{
+    int i;
+    bstree_traverse_inorder(model->table, NULL, free_word);
+    bstree_destroy(model->table);
+    for (i = 0; i < model->n_parts; i++) {
+        arena_free(&model->parts[i].arena);
+    }
+    free(model->parts);
 }
 
 static void print_transition_table(struct bstree *table)
 {
+    struct bstree_stats stats;
     bstree_traverse_inorder(table, NULL, print_tree);
+    bstree_stats(table, &stats);
+    printf("\n%d words, height %d (%d at best), %.2f nodes per search\n",
+            stats.size, stats.height, stats.min_height, stats.average_depth);
+    if (stats.counting) {
+        printf("%ld comparisons, %ld single and %ld double rotations,"
+                " %ld nodes allocated, %ld freed\n", stats.compare_calls,
+                stats.single_rotations, stats.double_rotations,
+                stats.nodes_allocated, stats.nodes_freed);
+    }
 }
 
 static void generate_chain(struct bstree *table, struct cli_opts *opts)
@@ -284,25 +522,25 @@ static void generate_chain(struct bstree *table, struct cli_opts *opts)
             line_len = 0;
         }
         line_len += printf("%s%s", initial->str, opts->delimiter);
-        key_word.str = choose_next(initial)->str;
+        key_word.str = choose_next(initial);
     }
     putchar('\n');
 }
 
 int main(int argc, char **argv)
 {
-    struct bstree *table;
+    struct model model;
     struct cli_opts opts;
     if (parse_opts(argc, argv, &opts)) {
         print_usage(argv);
         return 1;
     }
     srand(time(NULL));
-    table = generate_transition_table(&opts);
+    generate_transition_table(&model, &opts);
     if (opts.print_stats) {
-        print_transition_table(table);
+        print_transition_table(model.table);
     }
-    generate_chain(table, &opts);
-    bstree_destroy(table);
+    generate_chain(model.table, &opts);
+    destroy_model(&model);
     return 0;
 }
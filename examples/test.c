@@ -17,12 +17,36 @@
 */
 
 #include "bstree.h"
+#include "bstree_typed.h"
 
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #define ARR_SIZE 16
 
+/* The checks run on keys in [0, N_KEYS) */
+#define N_KEYS 512
+#define N_OPS 20000
+#define MAX_OBJS (1 << 19)
+#define N_READERS 4
+#define N_SNAPSHOTS 4
+
+/* As in bstree_btree.c, the fewest objects a node but the root holds */
+#define BTREE_MIN_KEYS 7
+
+/* Keys of the trees large enough for several threads to share the work */
+#define N_BIG_KEYS (1 << 16)
+
+/* As in bstree_rcu.c, the most retired objects an RCU tree leaves unfreed
+ * when no snapshot holds them
+ */
+#define RETIRE_BATCH 1024
+
 struct int_arr {
     int *arr;
     int last;
@@ -77,6 +101,1712 @@ int mk_array(void *ptr, void *it_data)
     return 0;
 }
 
+/* The objects of the checks come from objs, and are never given back to
+ * malloc, so that freeing one only marks it. This catches objects freed
+ * twice, or while still in a tree, without relying on a sanitizer, which
+ * make test adds for the nodes the trees allocate.
+ */
+struct obj {
+    int key;
+    int freed;
+};
+
+struct obj objs[MAX_OBJS];
+int n_objs;
+int failures;
+
+void check(int ok, const char *name, const char *what)
+{
+    /* One bug tends to fail the same check over and over */
+    if (!ok && failures++ < 20) {
+        printf("FAIL %s: %s\n", name, what);
+    }
+}
+
+struct obj *new_obj(int key)
+{
+    struct obj *o = &objs[n_objs++];
+    o->key = key;
+    o->freed = 0;
+    return o;
+}
+
+void free_obj(void *p)
+{
+    struct obj *o = p;
+    check(!o->freed, "objects", "freed twice");
+    __atomic_store_n(&o->freed, 1, __ATOMIC_RELAXED);
+}
+
+/* Check that every object made since the last call was freed, the trees
+ * holding them being destroyed, and start over.
+ */
+void check_all_freed(const char *name)
+{
+    int i, freed = 1;
+    for (i = 0; i < n_objs; i++) {
+        freed = freed && objs[i].freed;
+    }
+    check(freed, name, "objects left unfreed");
+    n_objs = 0;
+}
+
+/* What a traversal saw of keys in [0, n_keys), for check_object */
+struct contents {
+    int *counts;
+    int n_keys;
+    int last;
+    int ok;
+};
+
+/* Objects must come in order, and not be freed */
+int check_object(void *ptr, void *it_data)
+{
+    const struct obj *o = ptr;
+    struct contents *c = it_data;
+    c->ok = c->ok && o->key >= c->last && o->key < c->n_keys
+        && !__atomic_load_n(&o->freed, __ATOMIC_RELAXED);
+    if (c->ok) {
+        c->counts[o->key]++;
+        c->last = o->key;
+    }
+    return !c->ok;
+}
+
+/* Compare the tree with counts, the count of every key in [0, n_keys) it
+ * should hold, through a traversal, searches, counts and size queries.
+ */
+void check_keys(const char *name, struct bstree *tree, const int *counts,
+        int n_keys)
+{
+    struct contents c = { calloc(n_keys, sizeof(int)), n_keys, 0, 1 };
+    int i, size = 0;
+    long size_cnt = 0;
+    bstree_traverse_inorder_cnt(tree, &c, check_object);
+    check(c.ok && !memcmp(c.counts, counts, n_keys * sizeof(int)), name,
+            "traversal");
+    for (i = 0; i < n_keys; i++) {
+        struct obj *o = bstree_search(tree, &i);
+        check(counts[i] ? o && o->key == i && !o->freed : !o, name,
+                "search");
+        check(bstree_count(tree, &i) == counts[i], name, "count");
+        size += counts[i] > 0;
+        size_cnt += counts[i];
+    }
+    check(bstree_size(tree) == size, name, "size");
+    check(bstree_size_cnt(tree) == size_cnt, name, "size_cnt");
+    free(c.counts);
+}
+
+void check_contents(const char *name, struct bstree *tree, const int *counts)
+{
+    check_keys(name, tree, counts, N_KEYS);
+}
+
+/* Check rank and select queries of the tree against counts, every key in
+ * [0, n_keys) and either end past them, the counts making ranks with and
+ * without duplicates differ.
+ */
+void check_order(const char *name, const struct bstree *tree,
+        const int *counts, int n_keys)
+{
+    int i, rank = 0, before = -1, after = n_keys;
+    long rank_cnt = 0;
+    for (i = 0; i < n_keys; i++) {
+        struct obj *o;
+        check(bstree_rank(tree, &i) == rank, name, "rank");
+        check(bstree_rank_cnt(tree, &i) == rank_cnt, name, "rank_cnt");
+        if (counts[i]) {
+            o = bstree_select(tree, rank);
+            check(o && o->key == i, name, "select");
+            o = bstree_select_cnt(tree, rank_cnt);
+            check(o && o->key == i, name, "select_cnt");
+            o = bstree_select_cnt(tree, rank_cnt + counts[i] - 1);
+            check(o && o->key == i, name, "select_cnt of the last copy");
+            rank++;
+            rank_cnt += counts[i];
+        }
+    }
+    check(bstree_rank(tree, &before) == 0 && bstree_rank(tree, &after) == rank
+            && bstree_rank_cnt(tree, &before) == 0
+            && bstree_rank_cnt(tree, &after) == rank_cnt, name,
+            "rank of keys past either end");
+    check(!bstree_select(tree, -1) && !bstree_select(tree, rank)
+            && !bstree_select_cnt(tree, -1)
+            && !bstree_select_cnt(tree, rank_cnt), name,
+            "select out of range");
+}
+
+/* Check that weighted sampling picks the object at the position r stands
+ * for, counting every copy, by trying the middle of every position.
+ */
+void check_sample(const char *name, const struct bstree *tree,
+        const int *counts, int n_keys)
+{
+    long total = 0, j = 0;
+    int i, k;
+    struct obj *o;
+    for (i = 0; i < n_keys; i++) {
+        total += counts[i];
+    }
+    for (i = 0; i < n_keys; i++) {
+        for (k = 0; k < counts[i]; k++, j++) {
+            o = bstree_sample_weighted(tree, (j + 0.5) / total);
+            check(o && o->key == i, name, "weighted sample");
+        }
+    }
+    o = bstree_sample_weighted(tree, 0);
+    check(total ? o && counts[o->key] && !bstree_rank(tree, &o->key) : !o,
+            name, "weighted sample of 0");
+}
+
+/* The smallest key present not less than key (greater if strict), or -1 */
+int next_key(const int *counts, int n_keys, int key, int strict)
+{
+    int i;
+    for (i = key < 0 ? 0 : key + strict; i < n_keys; i++) {
+        if (counts[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Walk the tree with iterators, forward from the first object, backward
+ * from the last one and forward from every key in [-1, n_keys].
+ */
+void check_iters(const char *name, const struct bstree *tree,
+        const int *counts, int n_keys)
+{
+    struct bstree_iter iter;
+    struct obj *o = bstree_iter_first(&iter, tree);
+    int i;
+    for (i = 0; i < n_keys; i++) {
+        if (counts[i]) {
+            check(o && o->key == i && bstree_iter_count(&iter) == counts[i],
+                    name, "iterating forward");
+            o = bstree_iter_next(&iter);
+        }
+    }
+    check(!o && !bstree_iter_object(&iter) && !bstree_iter_count(&iter)
+            && !bstree_iter_next(&iter) && !bstree_iter_prev(&iter), name,
+            "past the end");
+    o = bstree_iter_last(&iter, tree);
+    for (i = n_keys; i-- > 0;) {
+        if (counts[i]) {
+            check(o && o->key == i && bstree_iter_count(&iter) == counts[i],
+                    name, "iterating backward");
+            o = bstree_iter_prev(&iter);
+        }
+    }
+    check(!o && !bstree_iter_prev(&iter), name, "before the start");
+    for (i = -1; i <= n_keys; i++) {
+        int k = next_key(counts, n_keys, i, 0);
+        o = bstree_iter_seek(&iter, tree, &i);
+        check(k < 0 ? !o : o && o->key == k, name, "seek");
+        if (k >= 0) {
+            k = next_key(counts, n_keys, k, 1);
+            o = bstree_iter_next(&iter);
+            check(k < 0 ? !o : o && o->key == k, name, "next after seek");
+        }
+    }
+}
+
+/* Check the lower and upper bounds of every key in [-1, n_keys] */
+void check_bounds(const char *name, const struct bstree *tree,
+        const int *counts, int n_keys)
+{
+    int key;
+    for (key = -1; key <= n_keys; key++) {
+        struct obj *lower = bstree_lower_bound(tree, &key);
+        struct obj *upper = bstree_upper_bound(tree, &key);
+        int l = next_key(counts, n_keys, key, 0);
+        int u = next_key(counts, n_keys, key, 1);
+        check(l < 0 ? !lower : lower && lower->key == l, name, "lower bound");
+        check(u < 0 ? !upper : upper && upper->key == u, name, "upper bound");
+    }
+}
+
+/* Check a range traversal from lo to hi, either of which may be -1 for
+ * none, against counts.
+ */
+void check_range(const char *name, const struct bstree *tree,
+        const int *counts, int lo, int hi)
+{
+    int expected[N_KEYS] = { 0 }, i;
+    struct contents c = { calloc(N_KEYS, sizeof(int)), N_KEYS, 0, 1 };
+    for (i = lo < 0 ? 0 : lo; i < (hi < 0 ? N_KEYS : hi); i++) {
+        expected[i] = counts[i];
+    }
+    bstree_traverse_range_cnt(tree, lo < 0 ? NULL : &lo, hi < 0 ? NULL : &hi,
+            &c, check_object);
+    check(c.ok && !memcmp(c.counts, expected, sizeof expected), name,
+            "range traversal");
+    free(c.counts);
+}
+
+/* Range traversals between random bounds, open ended and empty ones
+ * included
+ */
+void check_ranges(const char *name, const struct bstree *tree,
+        const int *counts)
+{
+    int i;
+    check_range(name, tree, counts, -1, -1);
+    check_range(name, tree, counts, N_KEYS / 2, N_KEYS / 2);
+    check_range(name, tree, counts, N_KEYS / 2, N_KEYS / 4);
+    for (i = 0; i < 16; i++) {
+        int lo = rand() % (N_KEYS + 1) - 1;
+        int hi = lo + rand() % (N_KEYS / 4) - 1;
+        check_range(name, tree, counts, lo, hi < N_KEYS ? hi : -1);
+    }
+}
+
+/* Look random keys up in a batch, some outside [0, N_KEYS), and compare
+ * with searching them one by one.
+ */
+void check_search_batch(const char *name, const struct bstree *tree,
+        const int *counts)
+{
+    int keys[100], i;
+    const void *ptrs[100];
+    void *out[100];
+    for (i = 0; i < 100; i++) {
+        keys[i] = rand() % (N_KEYS + 2) - 1;
+        ptrs[i] = &keys[i];
+    }
+    bstree_search_batch(tree, ptrs, 0, out);
+    bstree_search_batch(tree, ptrs, 100, out);
+    for (i = 0; i < 100; i++) {
+        const struct obj *o = out[i];
+        int k = keys[i];
+        check(k >= 0 && k < N_KEYS && counts[k] ? o && o->key == k : !o,
+                name, "search batch");
+    }
+}
+
+/* The queries of the order, on trees not using the default layout */
+void check_other_queries(const char *name, const struct bstree *tree,
+        const int *counts)
+{
+    struct bstree_iter iter;
+    int key = 0;
+    check_order(name, tree, counts, N_KEYS);
+    check_sample(name, tree, counts, N_KEYS);
+    check(!bstree_iter_first(&iter, tree) && !bstree_iter_last(&iter, tree)
+            && !bstree_iter_seek(&iter, tree, &key), name,
+            "iterators past the end");
+    check_bounds(name, tree, counts, N_KEYS);
+}
+
+void *make_obj(const void *key)
+{
+    return new_obj(*(const int *)key);
+}
+
+/* Apply a random update to the tree, and to counts the same way */
+void update(struct bstree *tree, int *counts)
+{
+    int key = rand() % N_KEYS;
+    struct obj *o;
+    switch (rand() % 8) {
+    case 0: case 1: case 2:
+        bstree_insert(tree, new_obj(key));
+        counts[key]++;
+        break;
+    case 3:
+        bstree_replace(tree, new_obj(key));
+        counts[key] += !counts[key];
+        break;
+    case 4:
+        o = bstree_find_or_insert(tree, &key, make_obj);
+        check(o && o->key == key, "update", "find_or_insert");
+        counts[key] += !counts[key];
+        break;
+    default:
+        bstree_remove(tree, &key);
+        counts[key] = 0;
+        break;
+    }
+}
+
+void check_rcu_updates(void)
+{
+    struct bstree *tree = bstree_new_rcu(cmp_int, free_obj);
+    int counts[N_KEYS] = { 0 }, op;
+    srand(1);
+    for (op = 0; op < N_OPS; op++) {
+        update(tree, counts);
+        if (op % 64 == 0) {
+            check_contents("rcu", tree, counts);
+        }
+    }
+    check_contents("rcu", tree, counts);
+    check_other_queries("rcu", tree, counts);
+    bstree_destroy(tree);
+    check_all_freed("rcu");
+}
+
+/* Readers of a tree shared between threads, running while the main thread
+ * updates the odd keys, the multiples of 4 staying in the tree throughout.
+ */
+struct reader {
+    struct bstree *tree;
+    int rcu;
+    int stop;
+    int errors;
+};
+
+/* A traversal of a synchronized tree, searching it for every object it
+ * visits, which must find that object as the tree cannot change meanwhile
+ */
+struct nested {
+    struct contents c;
+    const struct bstree *tree;
+    int errors;
+};
+
+int check_nested(void *ptr, void *it_data)
+{
+    struct nested *n = it_data;
+    const struct obj *o = ptr;
+    n->errors += bstree_search(n->tree, &o->key) != ptr;
+    return check_object(ptr, &n->c);
+}
+
+void *read_shared(void *arg)
+{
+    struct reader *r = arg;
+    int i = 0;
+    unsigned seed = 1;
+    while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+        int key = rand_r(&seed) % N_KEYS;
+        int token = r->rcu ? bstree_rcu_read_lock(r->tree) : 0;
+        struct obj *o = bstree_search(r->tree, &key);
+        /* Unless read locked, an object removed once found may be freed */
+        int stable = key % 4 == 0 || r->rcu;
+        if (o ? o->key != key
+                || (stable && __atomic_load_n(&o->freed, __ATOMIC_RELAXED))
+                : key % 4 == 0) {
+            r->errors++;
+        }
+        if (r->rcu) {
+            bstree_rcu_read_unlock(r->tree, token);
+        }
+        if (++i % 256 == 0) {
+            /* Every traversal sees one version, with the stable keys */
+            int counts[N_KEYS] = { 0 }, k;
+            struct nested n = { { counts, N_KEYS, 0, 1 }, r->tree, 0 };
+            bstree_traverse_inorder(r->tree, &n,
+                    r->rcu ? check_object : check_nested);
+            r->errors += !n.c.ok + n.errors;
+            for (k = 0; k < N_KEYS; k += 4) {
+                r->errors += counts[k] != 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Update the odd keys of the tree while readers search and traverse it */
+void check_readers(const char *name, struct bstree *tree, int rcu)
+{
+    struct reader r = { tree, rcu, 0, 0 };
+    pthread_t threads[N_READERS];
+    int counts[N_KEYS] = { 0 }, i, op;
+    for (i = 0; i < N_KEYS; i += 4) {
+        bstree_insert(tree, new_obj(i));
+        counts[i] = 1;
+    }
+    for (i = 0; i < N_READERS; i++) {
+        pthread_create(&threads[i], NULL, read_shared, &r);
+    }
+    srand(2);
+    for (op = 0; op < N_OPS; op++) {
+        int key = rand() % N_KEYS | 1;
+        if (rand() % 2) {
+            bstree_insert(tree, new_obj(key));
+            counts[key]++;
+        } else {
+            bstree_remove(tree, &key);
+            counts[key] = 0;
+        }
+    }
+    __atomic_store_n(&r.stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < N_READERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    check(r.errors == 0, name, "concurrent readers");
+    check_contents(name, tree, counts);
+    bstree_destroy(tree);
+    check_all_freed(name);
+}
+
+/* Random updates of a synchronized tree, then readers running along with
+ * a writer
+ */
+void check_sync(void)
+{
+    struct bstree *tree = bstree_new_sync(cmp_int, free_obj);
+    int counts[N_KEYS] = { 0 }, op;
+    srand(8);
+    for (op = 0; op < N_OPS; op++) {
+        update(tree, counts);
+        if (op % 64 == 0) {
+            check_contents("sync", tree, counts);
+        }
+    }
+    check_contents("sync", tree, counts);
+    check_other_queries("sync", tree, counts);
+    bstree_destroy(tree);
+    check_all_freed("sync");
+    check_readers("sync", bstree_new_sync(cmp_int, free_obj), 0);
+}
+
+/* The number of objects neither freed nor in a tree of the given size */
+int unfreed(int size)
+{
+    int i, n = 0;
+    for (i = 0; i < n_objs; i++) {
+        n += !objs[i].freed;
+    }
+    return n - size;
+}
+
+/* Update an RCU tree while holding snapshots of it, destroyed out of order,
+ * each of which must keep what the tree held when it was taken.
+ */
+void check_snapshots(void)
+{
+    struct bstree *tree = bstree_new_rcu(cmp_int, free_obj);
+    struct bstree *snapshots[N_SNAPSHOTS] = { NULL };
+    int counts[N_KEYS] = { 0 }, saved[N_SNAPSHOTS][N_KEYS];
+    int op, i;
+    struct bstree *plain = bstree_new(cmp_int, NULL);
+    check(!bstree_snapshot(plain), "snapshot", "of a plain tree");
+    bstree_destroy(plain);
+    srand(3);
+    for (op = 0; op < N_OPS; op++) {
+        update(tree, counts);
+        if (op % 250 == 0) {
+            i = rand() % N_SNAPSHOTS;
+            if (snapshots[i]) {
+                check_contents("snapshot", snapshots[i], saved[i]);
+                bstree_destroy(snapshots[i]);
+            }
+            snapshots[i] = bstree_snapshot(tree);
+            memcpy(saved[i], counts, sizeof counts);
+            check(!bstree_find_or_insert(snapshots[i], &i, make_obj),
+                    "snapshot", "find_or_insert");
+        }
+        if (op % 64 == 0) {
+            for (i = 0; i < N_SNAPSHOTS; i++) {
+                if (snapshots[i]) {
+                    check_contents("snapshot", snapshots[i], saved[i]);
+                }
+            }
+        }
+    }
+    check_other_queries("snapshot", snapshots[0], saved[0]);
+    /* Without snapshots, the objects they kept go with the next batch */
+    for (i = N_SNAPSHOTS; i-- > 0;) {
+        bstree_destroy(snapshots[(i * 3) % N_SNAPSHOTS]);
+    }
+    for (op = 0; op < 2 * RETIRE_BATCH; op++) {
+        update(tree, counts);
+    }
+    check(unfreed(bstree_size(tree)) < RETIRE_BATCH, "snapshot",
+            "retired objects kept after the snapshots are gone");
+    check_contents("rcu", tree, counts);
+    bstree_destroy(tree);
+    check_all_freed("snapshot");
+}
+
+/* The keys, offset to keep negative ones below the others */
+uint64_t key_obj(const void *p)
+{
+    return (int64_t)((const struct obj *)p)->key - INT32_MIN;
+}
+
+int links_ok(const struct bstree_link *link)
+{
+    const struct bstree_link *l = link->left, *r = link->right;
+    int hl = l ? l->height : -1, hr = r ? r->height : -1;
+    return link->count > 0
+        && link->height == (hl > hr ? hl : hr) + 1
+        && hl - hr <= 1 && hr - hl <= 1
+        && link->size == 1 + (l ? l->size : 0) + (r ? r->size : 0)
+        && link->size_cnt == link->count + (l ? l->size_cnt : 0)
+            + (r ? r->size_cnt : 0)
+        && (!l || links_ok(l)) && (!r || links_ok(r));
+}
+
+/* Check the heights, balance and subtree sizes of a tree with the default
+ * layout, and its contents.
+ */
+void check_tree(const char *name, struct bstree *tree, const int *counts,
+        int n_keys)
+{
+    const struct bstree_link *root = tree->root;
+    check(!root || links_ok(root), name, "AVL invariants");
+    check(bstree_height(tree) == (root ? root->height : -1), name, "height");
+    check(!root || root->height < 1.45 * log2(root->size + 2), name,
+            "height bound");
+    check_keys(name, tree, counts, n_keys);
+}
+
+/* Trees of the default layouts moving nodes to each other */
+enum { PLAIN, POOLED, KEYED, N_LAYOUTS };
+
+const char *layout_names[] = { "plain", "pooled", "keyed" };
+
+struct bstree *new_tree(int layout)
+{
+    switch (layout) {
+    case PLAIN: return bstree_new(cmp_int, free_obj);
+    case POOLED: return bstree_new_pooled(cmp_int, free_obj);
+    default: return bstree_new_keyed(cmp_int, free_obj, key_obj);
+    }
+}
+
+/* Trees of the other constructors taking no more than those of the default
+ * layouts
+ */
+#define N_BACKENDS 4
+
+struct bstree *(*const backends[N_BACKENDS])(
+        int (*compare_object)(const void *lhs, const void *rhs),
+        void (*free_object)(void *object)) = {
+    bstree_new_compact, bstree_new_btree, bstree_new_sync, bstree_new_rcu
+};
+
+const char *backend_names[N_BACKENDS] = { "compact", "btree", "sync", "rcu" };
+
+/* Random updates of trees of every default layout, checked against
+ * reference counts along the way.
+ */
+void check_updates(void)
+{
+    int layout, op;
+    srand(9);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        struct bstree *tree = new_tree(layout);
+        int counts[N_KEYS] = { 0 };
+        for (op = 0; op < N_OPS; op++) {
+            update(tree, counts);
+            if (op % 64 == 0) {
+                check_tree(name, tree, counts, N_KEYS);
+            }
+        }
+        check_tree(name, tree, counts, N_KEYS);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
+
+/* Empty a full tree by removing the key in the middle of those left over
+ * and over, which sits high in the tree and mostly has two children, so
+ * that its successor takes its place along with its count. Counts from 1 to
+ * 3 make the counts that move matter.
+ */
+void check_remove_middle(void)
+{
+    int layout, i, j;
+    srand(10);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        struct bstree *tree = new_tree(layout);
+        int counts[N_KEYS], lo = 0, hi = N_KEYS;
+        for (i = 0; i < N_KEYS; i++) {
+            int key = (i * 40503) % N_KEYS;
+            counts[key] = 1 + rand() % 3;
+            for (j = 0; j < counts[key]; j++) {
+                bstree_insert(tree, new_obj(key));
+            }
+        }
+        for (i = 0; i < N_KEYS; i++) {
+            int key = (lo + hi) / 2;
+            while (!counts[key]) {
+                key++;
+            }
+            bstree_remove(tree, &key);
+            counts[key] = 0;
+            while (lo < hi && !counts[lo]) {
+                lo++;
+            }
+            while (hi > lo && !counts[hi - 1]) {
+                hi--;
+            }
+            if (i % 16 == 0) {
+                check_tree(name, tree, counts, N_KEYS);
+            }
+        }
+        check_tree(name, tree, counts, N_KEYS);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
+
+/* Calls to the comparison function, counted by cmp_counted */
+long compare_calls;
+
+int cmp_counted(const void *lhs, const void *rhs)
+{
+    compare_calls++;
+    return cmp_int(lhs, rhs);
+}
+
+/* Searches, counts, insertions and removals descend the tree once, which
+ * takes one comparison per level at most.
+ */
+void check_compares(void)
+{
+    struct bstree *tree = bstree_new(cmp_counted, free_obj);
+    int counts[N_KEYS] = { 0 }, i, key, height;
+    srand(11);
+    for (i = 0; i < N_KEYS; i++) {
+        key = rand() % N_KEYS;
+        bstree_insert(tree, new_obj(key));
+        counts[key]++;
+    }
+    for (key = -1; key <= N_KEYS; key++) {
+        height = bstree_height(tree);
+        compare_calls = 0;
+        bstree_search(tree, &key);
+        check(compare_calls <= height + 1, "compares", "search");
+        compare_calls = 0;
+        bstree_count(tree, &key);
+        check(compare_calls <= height + 1, "compares", "count");
+        if (key >= 0 && key < N_KEYS) {
+            compare_calls = 0;
+            if (key % 2) {
+                bstree_remove(tree, &key);
+                counts[key] = 0;
+            } else {
+                bstree_insert(tree, new_obj(key));
+                counts[key]++;
+            }
+            check(compare_calls <= height + 1, "compares", "update");
+        }
+    }
+    check_tree("compares", tree, counts, N_KEYS);
+    bstree_destroy(tree);
+    check_all_freed("compares");
+}
+
+/* Objects of intrusive trees, embedding their links */
+struct item {
+    int key;
+    struct bstree_link link;
+};
+
+int cmp_link(const struct bstree_link *lhs, const struct bstree_link *rhs)
+{
+    return bstree_entry(lhs, struct item, link)->key
+        - bstree_entry(rhs, struct item, link)->key;
+}
+
+/* Links must come in order, with the expected counts */
+int check_link(struct bstree_link *link, void *it_data)
+{
+    const struct item *item = bstree_entry(link, struct item, link);
+    struct contents *c = it_data;
+    c->ok = c->ok && item->key >= c->last && item->key < c->n_keys;
+    if (c->ok) {
+        c->counts[item->key] = link->count;
+        c->last = item->key + 1;
+    }
+    return !c->ok;
+}
+
+/* Random insertions and removals of an intrusive tree, with one item per
+ * key, which must be the one the tree holds while the key is in it, and
+ * another one inserted to raise the count when it is.
+ */
+void check_links(void)
+{
+    static struct item items[N_KEYS];
+    struct bstree_root root;
+    int counts[N_KEYS] = { 0 }, seen[N_KEYS], op;
+    bstree_root_init(&root, cmp_link);
+    srand(12);
+    for (op = 0; op < N_OPS; op++) {
+        struct item key = { rand() % N_KEYS, { NULL } };
+        struct bstree_link *link;
+        if (rand() % 3) {
+            items[key.key].key = key.key;
+            link = bstree_link_insert(&root,
+                    counts[key.key] ? &key.link : &items[key.key].link);
+            check(counts[key.key] ? link == &items[key.key].link : !link,
+                    "links", "insert");
+            counts[key.key]++;
+        } else {
+            link = bstree_link_remove(&root, &key.link);
+            check(counts[key.key] ? link == &items[key.key].link : !link,
+                    "links", "remove");
+            counts[key.key] = 0;
+        }
+        link = bstree_link_search(&root, &key.link);
+        check(counts[key.key] ? link == &items[key.key].link : !link, "links",
+                "search");
+        if (op % 64 == 0) {
+            struct contents c = { seen, N_KEYS, 0, 1 };
+            memset(seen, 0, sizeof seen);
+            bstree_link_traverse_inorder(&root, &c, check_link);
+            check(c.ok && !memcmp(seen, counts, sizeof seen), "links",
+                    "traversal");
+            check(!root.link || links_ok(root.link), "links",
+                    "AVL invariants");
+        }
+    }
+}
+
+/* Random updates of trees of every default layout, with the queries of the
+ * order checked along the way
+ */
+void check_queries(void)
+{
+    int layout, op;
+    srand(13);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        struct bstree *tree = new_tree(layout);
+        int counts[N_KEYS] = { 0 };
+        for (op = 0; op < N_OPS / 4; op++) {
+            update(tree, counts);
+            if (op % 256 == 0) {
+                check_order(name, tree, counts, N_KEYS);
+                check_sample(name, tree, counts, N_KEYS);
+                check_iters(name, tree, counts, N_KEYS);
+                check_bounds(name, tree, counts, N_KEYS);
+                check_ranges(name, tree, counts);
+                check_search_batch(name, tree, counts);
+            }
+        }
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
+
+/* Build trees of every default layout out of sorted objects, without and
+ * with equal ones, and into an empty tree. Trees already holding objects,
+ * made with any constructor, get them merged in, which moves the nodes of
+ * a tree made with bstree_new to the pool the build sets up.
+ */
+void check_build(void)
+{
+    static void *sorted[3 * N_KEYS];
+    int layout, shape, i, j, n;
+    srand(14);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        for (shape = 0; shape < 4; shape++) {
+            const char *name = layout_names[layout];
+            struct bstree *tree = new_tree(layout);
+            int counts[N_KEYS] = { 0 }, added[N_KEYS], cnt = shape % 2;
+            bstree_build_sorted(tree, sorted, 0);
+            check_tree(name, tree, counts, N_KEYS);
+            for (i = 0; i < (shape < 2 ? 0 : N_KEYS); i++) {
+                update(tree, counts);
+            }
+            for (i = n = 0; i < N_KEYS; i++) {
+                added[i] = rand() % 4 ? 1 + (cnt ? rand() % 3 : 0) : 0;
+                for (j = 0; j < added[i]; j++) {
+                    sorted[n++] = new_obj(i);
+                }
+                counts[i] += added[i];
+            }
+            if (cnt) {
+                bstree_build_sorted_cnt(tree, sorted, n);
+            } else {
+                bstree_build_sorted(tree, sorted, n);
+            }
+            check_tree(name, tree, counts, N_KEYS);
+            for (i = 0; i < N_KEYS; i++) {
+                update(tree, counts);
+            }
+            check_tree(name, tree, counts, N_KEYS);
+            bstree_destroy(tree);
+            check_all_freed(name);
+        }
+    }
+    for (i = 0; i < N_BACKENDS; i++) {
+        const char *name = backend_names[i];
+        struct bstree *tree = backends[i](cmp_int, free_obj);
+        int counts[N_KEYS] = { 0 };
+        for (j = 0; j < N_KEYS; j++) {
+            update(tree, counts);
+        }
+        for (j = n = 0; j < N_KEYS; j += 1 + rand() % 3) {
+            sorted[n++] = new_obj(j);
+            counts[j]++;
+        }
+        bstree_build_sorted(tree, sorted, n);
+        check_contents(name, tree, counts);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+    for (shape = 0; shape < 2; shape++) {
+        struct bstree *tree = new_tree(PLAIN);
+        int *counts = calloc(N_BIG_KEYS, sizeof *counts);
+        void **big = malloc(N_BIG_KEYS * sizeof *big);
+        for (i = n = 0; i < N_BIG_KEYS; i++) {
+            if (rand() % 4) {
+                big[n++] = new_obj(i);
+                counts[i] = 1;
+            }
+        }
+        bstree_set_threads(tree, 4);
+        if (shape) {
+            bstree_build_sorted_cnt(tree, big, n);
+        } else {
+            bstree_build_sorted(tree, big, n);
+        }
+        check_tree("parallel build", tree, counts, N_BIG_KEYS);
+        bstree_destroy(tree);
+        check_all_freed("parallel build");
+        free(big);
+        free(counts);
+    }
+}
+
+/* Apply the same random updates to a compact tree and to a tree of the
+ * default layout, which balances the same way and should end up just as
+ * tall. The compact tree is emptied and refilled along the way, so that
+ * every node comes from the free list of removed ones a few times over.
+ */
+void check_compact(void)
+{
+    struct bstree *tree = bstree_new_compact(cmp_int, free_obj);
+    struct bstree *plain = bstree_new(cmp_int, free_obj);
+    int counts[N_KEYS] = { 0 }, scratch[N_KEYS] = { 0 }, op, i;
+    for (op = 0; op < N_OPS; op++) {
+        /* The same update for both, the default tree counting in scratch */
+        unsigned seed = 7 + op;
+        srand(seed);
+        update(tree, counts);
+        srand(seed);
+        update(plain, scratch);
+        check(bstree_height(tree) == bstree_height(plain), "compact",
+                "height");
+        if (op % 64 == 0) {
+            check_contents("compact", tree, counts);
+        }
+        if (op % 5000 == 4999) {
+            for (i = 0; i < N_KEYS; i++) {
+                bstree_remove(tree, &i);
+                bstree_remove(plain, &i);
+                counts[i] = scratch[i] = 0;
+            }
+            check_contents("compact", tree, counts);
+            check(bstree_height(tree) == -1, "compact", "height when empty");
+        }
+    }
+    check_search_batch("compact", tree, counts);
+    check_other_queries("compact", tree, counts);
+    bstree_destroy(plain);
+    bstree_destroy(tree);
+    check_all_freed("compact");
+}
+
+/* The prefixes of strings must be ordered as the strings are, equal
+ * prefixes leaving the order to the comparison function.
+ */
+void check_prefixes(void)
+{
+    static const char *strs[] = { "", "a", "ab", "abc", "abcdefgh",
+        "abcdefghi", "abd", "b", "z\x7f", "\x80", "\xff", "\xff\xff" };
+    int n = sizeof strs / sizeof *strs, i, j;
+    for (i = 0; i < n; i++) {
+        for (j = i; j < n; j++) {
+            check(bstree_str_prefix(strs[i]) <= bstree_str_prefix(strs[j]),
+                    "prefixes", "order");
+        }
+    }
+}
+
+#define CMP_INT(a, b) (((a) > (b)) - ((a) < (b)))
+
+BSTREE_DEFINE(int_tree, int, CMP_INT)
+
+/* The heights, balance and counts of the subtree, and its number of nodes
+ * added to size
+ */
+int int_nodes_ok(const struct int_tree_node *node, int *size)
+{
+    const struct int_tree_node *l = node->left, *r = node->right;
+    int hl = l ? l->height : -1, hr = r ? r->height : -1;
+    ++*size;
+    return node->count > 0
+        && node->height == (hl > hr ? hl : hr) + 1
+        && hl - hr <= 1 && hr - hl <= 1
+        && (!l || int_nodes_ok(l, size)) && (!r || int_nodes_ok(r, size));
+}
+
+/* Keys must come in order, once each */
+int check_int_key(int *key, void *it_data)
+{
+    struct contents *c = it_data;
+    c->ok = c->ok && *key >= c->last && *key < c->n_keys;
+    if (c->ok) {
+        c->counts[*key]++;
+        c->last = *key + 1;
+    }
+    return !c->ok;
+}
+
+void check_int_tree(const struct int_tree *tree, const int *counts)
+{
+    int seen[N_KEYS] = { 0 }, size = 0, nodes = 0, i;
+    struct contents c = { seen, N_KEYS, 0, 1 };
+    check(!tree->root || int_nodes_ok(tree->root, &nodes), "typed",
+            "AVL invariants");
+    check(int_tree_height(tree) == (tree->root ? tree->root->height : -1),
+            "typed", "height");
+    int_tree_traverse_inorder(tree, &c, check_int_key);
+    for (i = 0; i < N_KEYS; i++) {
+        int *key = int_tree_search(tree, i);
+        check(seen[i] == (counts[i] > 0) && c.ok, "typed", "traversal");
+        check(counts[i] ? key && *key == i : !key, "typed", "search");
+        check(int_tree_count(tree, i) == counts[i], "typed", "count");
+        size += counts[i] > 0;
+    }
+    check(int_tree_size(tree) == size && nodes == size, "typed", "size");
+}
+
+/* Random insertions and removals of a tree of ints, then removals of the
+ * key in the middle of those left, which mostly has two children, until
+ * the tree is empty.
+ */
+void check_typed(void)
+{
+    struct int_tree tree;
+    int counts[N_KEYS] = { 0 }, op, lo = 0, hi = N_KEYS;
+    int_tree_init(&tree);
+    srand(15);
+    for (op = 0; op < N_OPS; op++) {
+        int key = rand() % N_KEYS;
+        if (rand() % 3) {
+            int_tree_insert(&tree, key);
+            counts[key]++;
+        } else {
+            int_tree_remove(&tree, key);
+            counts[key] = 0;
+        }
+        if (op % 64 == 0) {
+            check_int_tree(&tree, counts);
+        }
+    }
+    while (lo < hi) {
+        int key = (lo + hi) / 2;
+        while (!counts[key]) {
+            key++;
+        }
+        int_tree_remove(&tree, key);
+        counts[key] = 0;
+        check_int_tree(&tree, counts);
+        while (lo < hi && !counts[lo]) {
+            lo++;
+        }
+        while (hi > lo && !counts[hi - 1]) {
+            hi--;
+        }
+    }
+    check(!tree.root, "typed", "empty");
+    int_tree_insert(&tree, 1);
+    int_tree_destroy(&tree);
+    check(!tree.root && int_tree_size(&tree) == 0, "typed", "destroy");
+}
+
+/* Operands of the set operations: empty ones, random ones, ones disjoint
+ * from each other (even and odd keys), and a copy of the other operand.
+ * Keys present have counts from 1 to 3.
+ */
+enum { EMPTY, RANDOM, EVEN, ODD, COPY };
+
+void fill(struct bstree *tree, int *counts, int n_keys, int shape,
+        const int *other)
+{
+    int i, j;
+    for (i = 0; i < n_keys; i++) {
+        switch (shape) {
+        case EMPTY: counts[i] = 0; break;
+        case RANDOM: counts[i] = rand() % 4 ? 1 + rand() % 3 : 0; break;
+        case EVEN: counts[i] = i % 2 ? 0 : 1 + rand() % 3; break;
+        case ODD: counts[i] = i % 2 ? 1 + rand() % 3 : 0; break;
+        default: counts[i] = other[i]; break;
+        }
+    }
+    /* The keys are inserted out of order, n_keys being a power of two */
+    for (i = 0; i < n_keys; i++) {
+        int key = (i * 40503) & (n_keys - 1);
+        for (j = 0; j < counts[key]; j++) {
+            bstree_insert(tree, new_obj(key));
+        }
+    }
+}
+
+void check_set_op(int op, int la, int lb, int sa, int sb, int threads,
+        int n_keys)
+{
+    static const char *names[] = { "union", "intersect", "difference" };
+    struct bstree *tree = new_tree(la), *other = new_tree(lb);
+    int *a = calloc(n_keys, sizeof *a), *b = calloc(n_keys, sizeof *b);
+    int i;
+    fill(tree, a, n_keys, sa, NULL);
+    fill(other, b, n_keys, sb, a);
+    bstree_set_threads(tree, threads);
+    switch (op) {
+    case 0:
+        bstree_union(tree, other);
+        for (i = 0; i < n_keys; i++) {
+            a[i] += b[i];
+        }
+        break;
+    case 1:
+        bstree_intersect(tree, other);
+        for (i = 0; i < n_keys; i++) {
+            a[i] = a[i] < b[i] ? a[i] : b[i];
+        }
+        break;
+    default:
+        bstree_difference(tree, other);
+        for (i = 0; i < n_keys; i++) {
+            a[i] = a[i] > b[i] ? a[i] - b[i] : 0;
+        }
+        break;
+    }
+    memset(b, 0, n_keys * sizeof *b);
+    check_tree(names[op], tree, a, n_keys);
+    check_tree(names[op], other, b, n_keys);
+    bstree_destroy(other);
+    bstree_destroy(tree);
+    check_all_freed(names[op]);
+    free(b);
+    free(a);
+}
+
+/* Split a tree at a random key, and join the two parts back */
+void check_split_join(int la, int lb, int n_keys)
+{
+    struct bstree *tree = new_tree(la), *right = new_tree(lb);
+    int *a = calloc(n_keys, sizeof *a), *b = calloc(n_keys, sizeof *b);
+    int i, key = rand() % (n_keys + 2) - 1;
+    fill(tree, a, n_keys, RANDOM, NULL);
+    bstree_split(tree, &key, right);
+    for (i = 0; i < n_keys; i++) {
+        b[i] = i < key ? 0 : a[i];
+        a[i] = i < key ? a[i] : 0;
+    }
+    check_tree("split", tree, a, n_keys);
+    check_tree("split", right, b, n_keys);
+    bstree_join(tree, right);
+    for (i = 0; i < n_keys; i++) {
+        a[i] += b[i];
+        b[i] = 0;
+    }
+    check_tree("join", tree, a, n_keys);
+    check_tree("join", right, b, n_keys);
+    bstree_destroy(right);
+    bstree_destroy(tree);
+    check_all_freed("split");
+    free(b);
+    free(a);
+}
+
+/* Run every set operation on every pair of operand shapes and layouts,
+ * small trees on one thread, and trees large enough to be shared between
+ * threads on four.
+ */
+void check_set_ops(void)
+{
+    static const int shapes[][2] = { { EMPTY, EMPTY }, { EMPTY, RANDOM },
+        { RANDOM, EMPTY }, { EVEN, ODD }, { RANDOM, RANDOM },
+        { RANDOM, COPY } };
+    static const int layouts[][2] = { { PLAIN, PLAIN }, { POOLED, PLAIN },
+        { PLAIN, POOLED }, { POOLED, POOLED }, { KEYED, KEYED } };
+    int op, i, j;
+    srand(4);
+    for (op = 0; op < 3; op++) {
+        for (i = 0; i < 6; i++) {
+            for (j = 0; j < 5; j++) {
+                check_set_op(op, layouts[j][0], layouts[j][1], shapes[i][0],
+                        shapes[i][1], 1, N_KEYS);
+                check_set_op(op, layouts[j][0], layouts[j][1], shapes[i][0],
+                        shapes[i][1], 4, N_BIG_KEYS);
+            }
+        }
+    }
+    for (j = 0; j < 5; j++) {
+        for (i = 0; i < 8; i++) {
+            check_split_join(layouts[j][0], layouts[j][1], N_KEYS);
+        }
+        check_split_join(layouts[j][0], layouts[j][1], N_BIG_KEYS);
+    }
+}
+
+/* What one thread of bstree_parallel_for_each saw of the tree */
+struct part {
+    int first;
+    int last;
+    int n;
+    int ok;
+    long sum;
+};
+
+int visit_part(void *ptr, void *it_data)
+{
+    const struct obj *o = ptr;
+    struct part *p = it_data;
+    p->ok = p->ok && (!p->n || o->key > p->last) && !o->freed;
+    if (!p->n) {
+        p->first = o->key;
+    }
+    p->last = o->key;
+    p->n++;
+    p->sum += o->key;
+    return 0;
+}
+
+/* The parts must follow each other in order */
+void combine_parts(void *acc, void *other)
+{
+    struct part *a = acc;
+    const struct part *b = other;
+    if (b->n) {
+        a->ok = a->ok && b->ok && (!a->n || a->last < b->first);
+        if (!a->n) {
+            a->first = b->first;
+        }
+        a->last = b->last;
+        a->n += b->n;
+        a->sum += b->sum;
+    }
+}
+
+#define MAX_PARTS 8
+
+/* Visit the tree on the given number of threads, which must see every
+ * node once between them, and the sum of their keys
+ */
+void check_for_each(const char *name, const struct bstree *tree,
+        int threads, int size, long sum)
+{
+    struct part parts[MAX_PARTS];
+    void *accs[MAX_PARTS];
+    int i;
+    for (i = 0; i < MAX_PARTS; i++) {
+        parts[i].n = 0;
+        parts[i].ok = 1;
+        parts[i].sum = 0;
+        accs[i] = &parts[i];
+    }
+    bstree_parallel_for_each(tree, threads, accs, visit_part, combine_parts);
+    check(parts[0].ok && parts[0].n == size && parts[0].sum == sum, name,
+            "parallel for each");
+}
+
+/* Visit a tree filled with n_keys keys on up to MAX_PARTS threads, and
+ * empty before that
+ */
+void check_parallel_tree(const char *name, struct bstree *tree, int n_keys)
+{
+    int *counts = calloc(n_keys, sizeof *counts), threads, size = 0, i;
+    long sum = 0;
+    check_for_each(name, tree, 4, 0, 0);
+    fill(tree, counts, n_keys, RANDOM, NULL);
+    for (i = 0; i < n_keys; i++) {
+        size += counts[i] > 0;
+        sum += counts[i] > 0 ? i : 0;
+    }
+    for (threads = -1; threads <= MAX_PARTS; threads++) {
+        check_for_each(name, tree, threads, size, sum);
+    }
+    bstree_destroy(tree);
+    check_all_freed(name);
+    free(counts);
+}
+
+/* Trees of every default layout large enough to be split between threads,
+ * and a compact one, visited on the calling thread
+ */
+void check_parallel(void)
+{
+    int layout;
+    srand(16);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        check_parallel_tree(layout_names[layout], new_tree(layout),
+                N_BIG_KEYS);
+    }
+    check_parallel_tree("compact", bstree_new_compact(cmp_int, free_obj),
+            N_KEYS);
+}
+
+/* Objects are saved as they are, so that the mapped ones are objects too */
+size_t encode_obj(const void *object, void *buf)
+{
+    if (buf) {
+        memcpy(buf, object, sizeof(struct obj));
+    }
+    return sizeof(struct obj);
+}
+
+/* Claims that objects take 4 GiB, too much for the entries of a file */
+size_t encode_huge(const void *object, void *buf)
+{
+    return encode_obj(object, buf) + ((size_t)1 << 32);
+}
+
+/* Save the tree to path, map it back and compare it with counts. Updates of
+ * the mapped tree must do nothing.
+ */
+void check_mapped(const char *name, struct bstree *tree, const int *counts,
+        const char *path)
+{
+    struct bstree *mapped;
+    struct obj extra = { 1, 0 };
+    int key = 2;
+    check(!bstree_save(tree, path, encode_obj), name, "save");
+    mapped = bstree_mmap_load(path, cmp_int);
+    check(mapped != NULL, name, "load");
+    if (mapped) {
+        check_contents(name, mapped, counts);
+        bstree_insert(mapped, &extra);
+        bstree_remove(mapped, &key);
+        check_contents(name, mapped, counts);
+        check(!bstree_find_or_insert(mapped, &key, make_obj), name,
+                "find_or_insert");
+        check_other_queries(name, mapped, counts);
+        bstree_destroy(mapped);
+    }
+}
+
+/* Overwrite the file at the given offset */
+void patch_file(const char *path, long offset, const void *bytes,
+        size_t length)
+{
+    FILE *f = fopen(path, "r+b");
+    fseek(f, offset, SEEK_SET);
+    fwrite(bytes, length, 1, f);
+    fclose(f);
+}
+
+/* Round trips of trees of every default layout through files, empty ones
+ * included. Then files cut short, or damaged, must fail to load.
+ */
+void check_files(void)
+{
+    char path[] = "/tmp/bstree_test.XXXXXX";
+    struct bstree *tree;
+    struct bstree *mapped;
+    int layout, counts[N_KEYS] = { 0 }, i;
+    long length;
+    FILE *f;
+    close(mkstemp(path));
+    srand(17);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        memset(counts, 0, sizeof counts);
+        tree = new_tree(layout);
+        check_mapped(name, tree, counts, path);
+        for (i = 0; i < N_KEYS; i++) {
+            update(tree, counts);
+        }
+        check_mapped(name, tree, counts, path);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+    tree = new_tree(PLAIN);
+    fill(tree, counts, N_KEYS, RANDOM, NULL);
+    check(!bstree_save(tree, path, encode_obj), "file", "save");
+    f = fopen(path, "rb");
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fclose(f);
+    for (i = 0; i < 5; i++) {
+        static const double cuts[] = { 0, 0.01, 0.5, 0.99, 1 };
+        check(!bstree_save(tree, path, encode_obj)
+                && !truncate(path, cuts[i] * length - (i == 4)), "file",
+                "truncate");
+        check(!bstree_mmap_load(path, cmp_int), "file", "load a cut file");
+    }
+    bstree_save(tree, path, encode_obj);
+    patch_file(path, 0, "x", 1);
+    check(!bstree_mmap_load(path, cmp_int), "file", "load a bad magic");
+    /* The entries of 16 bytes follow a header of 40, each starting with
+     * the offset of its object, and ending with its length, of 4 bytes.
+     */
+    for (i = 0; i < 2; i++) {
+        uint64_t huge = -8;
+        bstree_save(tree, path, encode_obj);
+        patch_file(path, 40 + 16 * 3 + (i ? 12 : 0), &huge, i ? 4 : 8);
+        check(!bstree_mmap_load(path, cmp_int), "file", "load a bad entry");
+    }
+    bstree_save(tree, path, encode_obj);
+    errno = 0;
+    check(bstree_save(tree, path, encode_huge) == -1 && errno == EOVERFLOW,
+            "file", "save objects of 4 GiB");
+    mapped = bstree_mmap_load(path, cmp_int);
+    check(mapped && bstree_size(mapped) == bstree_size(tree), "file",
+            "load a file left alone by a failed save");
+    if (mapped) {
+        bstree_destroy(mapped);
+    }
+    remove(path);
+    check(!bstree_mmap_load(path, cmp_int), "file", "load a missing file");
+    bstree_destroy(tree);
+    check_all_freed("file");
+}
+
+/* Freeze a tree, and compare the frozen copy with counts, through range
+ * traversals from every key as well. Updates of the copy must do nothing.
+ */
+void check_frozen_copy(const char *name, struct bstree *tree,
+        const int *counts)
+{
+    struct bstree *frozen = bstree_freeze(tree);
+    struct obj extra = { 1, 0 };
+    int key, size = bstree_size(tree), height = -1;
+    while (size > 0) {
+        height++;
+        size /= 2;
+    }
+    check_contents(name, frozen, counts);
+    check(bstree_height(frozen) == height, name, "height");
+    for (key = -1; key <= N_KEYS; key++) {
+        check_range(name, frozen, counts, key, -1);
+        check_range(name, frozen, counts, -1, key);
+    }
+    check_ranges(name, frozen, counts);
+    bstree_insert(frozen, &extra);
+    key = 2;
+    bstree_remove(frozen, &key);
+    check_contents(name, frozen, counts);
+    check(!bstree_find_or_insert(frozen, &key, make_obj), name,
+            "find_or_insert");
+    check_other_queries(name, frozen, counts);
+    bstree_destroy(frozen);
+}
+
+/* Frozen copies of trees of every default layout, the prefixes of keyed
+ * ones being laid out along, empty and full ones included
+ */
+void check_frozen(void)
+{
+    int layout, i;
+    srand(18);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        struct bstree *tree = new_tree(layout);
+        int counts[N_KEYS] = { 0 };
+        check_frozen_copy(name, tree, counts);
+        for (i = 0; i < N_KEYS; i++) {
+            update(tree, counts);
+        }
+        check_frozen_copy(name, tree, counts);
+        for (i = 0; i < N_KEYS; i++) {
+            bstree_insert(tree, new_obj(i));
+            counts[i]++;
+        }
+        check_frozen_copy(name, tree, counts);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+    for (i = 0; i < N_BACKENDS; i++) {
+        struct bstree *tree = backends[i](cmp_int, free_obj);
+        int counts[N_KEYS] = { 0 }, op;
+        for (op = 0; op < N_KEYS; op++) {
+            update(tree, counts);
+        }
+        check_frozen_copy(backend_names[i], tree, counts);
+        bstree_destroy(tree);
+        check_all_freed(backend_names[i]);
+    }
+}
+
+/* A B-tree of the given height (counted in edges) holds at least the
+ * objects of a root with one object and two children, with every other
+ * node at the minimum. More than that means the root was not collapsed, or
+ * the nodes not kept full enough.
+ */
+void check_btree_height(struct bstree *tree)
+{
+    int height = bstree_height(tree), size = bstree_size(tree), i;
+    long least = height < 0 ? 0 : 1;
+    for (i = 0; i < height; i++) {
+        least *= BTREE_MIN_KEYS + 1;
+    }
+    least = height > 0 ? 2 * least - 1 : least;
+    check(size >= least && (size > 0 || height == -1), "btree",
+            "height for the size");
+}
+
+/* Fill a B-tree with every key, and remove them all in the given order,
+ * ascending, descending or random, so that removals borrow from the right
+ * sibling, the left one, or either, and merge nodes down to an empty root.
+ */
+void check_btree_drain(int order)
+{
+    struct bstree *tree = bstree_new_btree(cmp_int, free_obj);
+    int counts[N_KEYS] = { 0 }, keys[N_KEYS], i;
+    for (i = 0; i < N_KEYS; i++) {
+        keys[i] = (i * 40503) % N_KEYS;
+        bstree_insert(tree, new_obj(keys[i]));
+        counts[keys[i]] = 1;
+    }
+    check_contents("btree", tree, counts);
+    check_btree_height(tree);
+    for (i = 0; i < N_KEYS; i++) {
+        int key = order == 0 ? i : order == 1 ? N_KEYS - 1 - i : keys[i];
+        bstree_remove(tree, &key);
+        counts[key] = 0;
+        check_btree_height(tree);
+        if (i % 16 == 0) {
+            check_contents("btree", tree, counts);
+        }
+    }
+    check_contents("btree", tree, counts);
+    bstree_destroy(tree);
+    check_all_freed("btree");
+}
+
+/* Random updates of a B-tree, checked after each against reference counts,
+ * with range traversals from time to time.
+ */
+void check_btree(void)
+{
+    struct bstree *tree = bstree_new_btree(cmp_int, free_obj);
+    int counts[N_KEYS] = { 0 }, op;
+    srand(5);
+    for (op = 0; op < N_OPS; op++) {
+        update(tree, counts);
+        check_btree_height(tree);
+        if (op % 64 == 0) {
+            int lo = rand() % (N_KEYS + 1) - 1;
+            int hi = lo + rand() % (N_KEYS / 4) - 1;
+            check_contents("btree", tree, counts);
+            check_range("btree", tree, counts, lo, hi < N_KEYS ? hi : -1);
+        }
+    }
+    check_other_queries("btree", tree, counts);
+    bstree_destroy(tree);
+    check_all_freed("btree");
+    for (op = 0; op < 3; op++) {
+        check_btree_drain(op);
+    }
+}
+
+uint64_t hash_obj(const void *p)
+{
+    return ((const struct obj *)p)->key * 0x9e3779b97f4a7c15u;
+}
+
+/* Random updates of cached trees of every default layout, checked through
+ * searches and counts going through the cache. A key found in the cache
+ * must be gone from it once removed, and give the new object once
+ * replaced, and the nodes moved by a union must not be found through it.
+ */
+void check_cache(void)
+{
+    int layout, op;
+    srand(19);
+    for (layout = PLAIN; layout < N_LAYOUTS; layout++) {
+        const char *name = layout_names[layout];
+        struct bstree *tree = new_tree(layout), *other = new_tree(layout);
+        int counts[N_KEYS] = { 0 }, key = N_KEYS / 2;
+        struct obj *o = new_obj(key);
+        long hits, misses;
+        bstree_set_cache(tree, 64, hash_obj);
+        for (op = 0; op < N_OPS; op++) {
+            update(tree, counts);
+            if (op % 64 == 0) {
+                check_tree(name, tree, counts, N_KEYS);
+            }
+        }
+        bstree_remove(tree, &key);
+        bstree_insert(tree, o);
+        counts[key] = 1;
+        check(bstree_search(tree, &key) == o && bstree_search(tree, &key) == o,
+                name, "cached search");
+        bstree_remove(tree, &key);
+        counts[key] = 0;
+        check(!bstree_search(tree, &key) && !bstree_count(tree, &key), name,
+                "cached search of a removed key");
+        bstree_insert(tree, new_obj(key));
+        bstree_search(tree, &key);
+        bstree_replace(tree, o = new_obj(key));
+        counts[key] = 1;
+        check(bstree_search(tree, &key) == o, name,
+                "cached search of a replaced key");
+        bstree_insert(other, new_obj(key));
+        bstree_union(tree, other);
+        counts[key]++;
+        check_tree(name, tree, counts, N_KEYS);
+        bstree_cache_stats(tree, &hits, &misses);
+        check(hits > 0 && misses > 0, name, "cache stats");
+        bstree_set_cache(tree, 0, NULL);
+        check_tree(name, tree, counts, N_KEYS);
+        bstree_destroy(other);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
+
+/* Search the tree through the hint, checking what is found */
+void check_hint_search(const char *name, struct bstree *tree,
+        struct bstree_hint *hint, const int *counts, int key)
+{
+    struct obj *o = bstree_hint_search(tree, hint, &key);
+    check(counts[key] ? o && o->key == key : !o, name, "hint search");
+}
+
+/* Insert and search keys close to the last one through a hint, and far
+ * from it, while the tree is also updated without the hint, so that it
+ * goes stale: nodes on its path are removed, or moved by rotations. Hints
+ * of another tree, and NULL ones, are used too.
+ */
+void check_hints(void)
+{
+    static const char *names[] = { "hint", "pooled hint", "keyed hint" };
+    int layout, op;
+    srand(6);
+    for (layout = PLAIN; layout <= KEYED; layout++) {
+        const char *name = names[layout];
+        struct bstree *tree = new_tree(layout), *other = new_tree(layout);
+        struct bstree_hint hint, foreign;
+        int counts[N_KEYS] = { 0 }, key = 0, far;
+        bstree_hint_init(&hint);
+        bstree_hint_init(&foreign);
+        for (op = 0; op < N_OPS; op++) {
+            far = rand() % N_KEYS;
+            switch (rand() % 8) {
+            case 0: case 1: case 2:
+                key = (key + rand() % 5 + N_KEYS - 1) % N_KEYS;
+                bstree_hint_insert(tree, &hint, new_obj(key));
+                counts[key]++;
+                break;
+            case 3:
+                check_hint_search(name, tree, &hint, counts, far);
+                break;
+            case 4:
+                bstree_insert(tree, new_obj(far));
+                counts[far]++;
+                break;
+            case 5:
+                bstree_remove(tree, &far);
+                counts[far] = 0;
+                break;
+            case 6:
+                bstree_hint_insert(tree, NULL, new_obj(far));
+                counts[far]++;
+                check_hint_search(name, tree, NULL, counts, far);
+                break;
+            default:
+                /* The hint of the other tree is moved there and back */
+                bstree_hint_insert(other, &foreign, new_obj(far));
+                check_hint_search(name, tree, &foreign, counts, far);
+                check(bstree_hint_search(other, &foreign, &far) != NULL,
+                        name, "hint search in the other tree");
+                break;
+            }
+            if (op % 64 == 0) {
+                check_tree(name, tree, counts, N_KEYS);
+            }
+        }
+        check_tree(name, tree, counts, N_KEYS);
+        bstree_destroy(other);
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
+
+/* The shape of empty and full trees, of the default layout and compact */
+void check_stats(void)
+{
+    struct bstree *tree = new_tree(PLAIN);
+    struct bstree *compact = bstree_new_compact(cmp_int, free_obj);
+    struct bstree_stats stats;
+    int i;
+    bstree_stats(tree, &stats);
+    check(stats.size == 0 && stats.height == -1 && stats.min_height == -1
+            && stats.average_depth == 0, "stats", "empty tree");
+    for (i = 0; i < N_KEYS; i++) {
+        int key = (i * 40503) % N_KEYS;
+        bstree_insert(tree, new_obj(key));
+        bstree_insert(compact, new_obj(key));
+    }
+    bstree_stats(tree, &stats);
+    /* N_KEYS being 2^9 */
+    check(stats.size == N_KEYS && stats.height == bstree_height(tree)
+            && stats.min_height == 9 && stats.average_depth >= 8
+            && stats.average_depth <= stats.height + 1, "stats", "shape");
+    bstree_stats(compact, &stats);
+    check(stats.size == N_KEYS && stats.height == bstree_height(compact)
+            && stats.min_height == 9 && stats.average_depth == 0, "stats",
+            "shape of a compact tree");
+#ifdef BSTREE_STATS
+    i = stats.compare_calls;
+    bstree_search(compact, &i);
+    bstree_stats(compact, &stats);
+    check(stats.counting && stats.compare_calls > i, "stats", "counters");
+#else
+    check(!stats.counting && !stats.compare_calls, "stats",
+            "counters without BSTREE_STATS");
+#endif
+    bstree_destroy(compact);
+    bstree_destroy(tree);
+    check_all_freed("stats");
+}
+
+/* Remove batches of random sorted keys from trees of every default layout
+ * and compact ones, the keys being in the tree with counts from 1 to 3, or
+ * not, or outside [0, N_KEYS) altogether.
+ */
+void check_remove_batch(void)
+{
+    int layout, i, round;
+    int keys[N_KEYS + 2];
+    const void *ptrs[N_KEYS + 2];
+    srand(20);
+    for (layout = PLAIN; layout <= N_LAYOUTS; layout++) {
+        const char *name = layout < N_LAYOUTS ? layout_names[layout]
+            : "compact";
+        struct bstree *tree = layout < N_LAYOUTS ? new_tree(layout)
+            : bstree_new_compact(cmp_int, free_obj);
+        int counts[N_KEYS];
+        fill(tree, counts, N_KEYS, RANDOM, NULL);
+        for (round = 0; round < 16; round++) {
+            int n = 0;
+            for (i = -1; i <= N_KEYS; i++) {
+                if (rand() % 16 < round) {
+                    keys[n] = i;
+                    ptrs[n] = &keys[n];
+                    n++;
+                }
+            }
+            bstree_remove_batch(tree, ptrs, n);
+            for (i = 0; i < n; i++) {
+                if (keys[i] >= 0 && keys[i] < N_KEYS) {
+                    counts[keys[i]] = 0;
+                }
+            }
+            if (layout < N_LAYOUTS) {
+                check_tree(name, tree, counts, N_KEYS);
+            } else {
+                check_contents(name, tree, counts);
+            }
+            if (round % 4 == 3) {
+                int more[N_KEYS];
+                fill(tree, more, N_KEYS, RANDOM, NULL);
+                for (i = 0; i < N_KEYS; i++) {
+                    counts[i] += more[i];
+                }
+            }
+        }
+        bstree_destroy(tree);
+        check_all_freed(name);
+    }
+}
 int main(void)
 {
     struct bstree *tree = bstree_new(cmp_int, free_int);
@@ -146,5 +1876,31 @@ int main(void)
     bstree_traverse_inorder(tree, NULL, print_int);
 
     bstree_destroy(tree);
-    return 0;
+
+    check_updates();
+    check_remove_middle();
+    check_compares();
+    check_links();
+    check_queries();
+    check_build();
+    check_compact();
+    check_prefixes();
+    check_typed();
+    check_sync();
+    check_rcu_updates();
+    check_readers("rcu", bstree_new_rcu(cmp_int, free_obj), 1);
+    check_snapshots();
+    check_set_ops();
+    check_parallel();
+    check_files();
+    check_frozen();
+    check_btree();
+    check_cache();
+    check_hints();
+    check_stats();
+    check_remove_batch();
+    printf("\n%d failed checks\n", failures);
+    /* Before the leak checker gets to exit */
+    fflush(stdout);
+    return failures != 0;
 }